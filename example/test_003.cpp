@@ -0,0 +1,31 @@
+/**
+ * Copyright 
+ * @file test_003.cpp
+ * @brief
+ * @author Shogo Sawai
+ * @date 2026-10-18 09:12:40
+ */
+#include "sym/sym.hpp"
+
+#include <iostream>
+
+using namespace sym;
+
+// J v and w^T J of a residual, without forming J
+class MyFactory : public Factory {
+ public:
+    DynamicInput x{"x", 3};
+    DynamicInput v{"v", 3};
+    DynamicInput w{"w", 2};
+    DynamicOutput r{"r", 2};
+    DynamicOutput jv{"jv", 2};
+    DynamicOutput wj{"wj", 3};
+
+    void generate() {
+        r[0] = sin(x[0] * x[1]) + x[2] * x[2];
+        r[1] = exp(x[1]) / (x[2] + 2.0);
+        jv.assign(jvp(r, x, v));
+        wj.assign(vjp(r, x, w));
+    }
+};
+OUTPUT_CXX_CODE_MAIN(MyFactory);
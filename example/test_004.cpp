@@ -0,0 +1,29 @@
+/**
+ * Copyright 
+ * @file test_004.cpp
+ * @brief
+ * @author Shogo Sawai
+ * @date 2026-10-18 14:05:12
+ */
+#include "sym/sym.hpp"
+
+#include <iostream>
+
+using namespace sym;
+
+// gradient of a pendulum simulated for 1000 steps, reversed with 8 checkpoints
+class MyFactory : public Factory {
+ public:
+    DynamicInput x0{"x0", 2};
+    DynamicInput p{"p", 2};
+    StaticInput dt{"dt", 1};
+
+    void generate() {
+        auto step = [this](const std::vector<Symbol> &x) {
+            return std::vector<Symbol>{x[0] + dt[0] * x[1], x[1] - dt[0] * (p[0] * sin(x[0]) + p[1] * x[1])};
+        };
+        auto loss = [](const std::vector<Symbol> &x) { return x[0] * x[0] + x[1] * x[1]; };
+        addCheckpointedGradient("g", std::vector<Symbol>{x0[0], x0[1]}, p, 1000, 8, step, loss);
+    }
+};
+OUTPUT_CXX_CODE_MAIN(MyFactory);
@@ -8,101 +8,203 @@
 #ifndef AS_EXTRACTOR_HPP_
 #define AS_EXTRACTOR_HPP_
 
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <tuple>
+
 #include "function.hpp"
 #include "unary_function.hpp"
 #include "binary_function.hpp"
 
 namespace sym {
 
+/**
+ * collects the terms of a sum with their coefficients, c*t is the term t
+ * with coefficient c and a subtracted term has coefficient -1. terms are
+ * sorted so that like terms are merged, which also cancels x - x, and the
+ * constants are folded into one. c*r*sin(a)^2 + c*r*cos(a)^2 is merged
+ * into c*r.
+ */
 class ASExtractor {
  public:
-    void addAdd(Symbol s) {
-        if (s->is<AddFunction>()) {
-            std::shared_ptr<AddFunction> p = s->ptr<AddFunction>();
-            addAdd(p->arg0);
-            addAdd(p->arg1);
-        } else if (s->is<SubFunction>()) {
-            std::shared_ptr<SubFunction> p = s->ptr<SubFunction>();
-            addAdd(p->arg0);
-            addSub(p->arg1);
-        } else if (s->is<NegFunction>()) {
-            std::shared_ptr<NegFunction> p = s->ptr<NegFunction>();
-            addSub(p->arg);
-        } else if (s->is<Constant>()) {
-            constants.push_back(s);
-        } else {
-            positives.push_back(s);
+    void addAdd(Symbol s) { add(s, 1); }
+    void addSub(Symbol s) { add(s, -1); }
+
+    // merges like terms, must be called before simplified
+    bool canBeSimplified() {
+        bool merged = mergeLikeTerms();
+        if (mergePythagorean()) {
+            mergeLikeTerms();
+            merged = true;
         }
+        return merged or num_constants > 1 or (num_constants == 1 and constant == 0);
     }
 
-    void addSub(Symbol s) {
-        if (s->is<AddFunction>()) {
-            std::shared_ptr<AddFunction> p = s->ptr<AddFunction>();
-            addSub(p->arg0);
-            addSub(p->arg1);
-        } else if (s->is<SubFunction>()) {
-            std::shared_ptr<SubFunction> p = s->ptr<SubFunction>();
-            addSub(p->arg0);
-            addAdd(p->arg1);
-        } else if (s->is<NegFunction>()) {
-            std::shared_ptr<NegFunction> p = s->ptr<NegFunction>();
-            addAdd(p->arg);
-        } else if (s->is<Constant>()) {
-            negative_constants.push_back(s);
-        } else {
-            negatives.push_back(s);
+    Symbol simplified() const {
+        std::vector<Symbol> positives, negatives;
+        if (constant != 0) {
+            positives.push_back(Symbol(constant));
+        }
+        for (auto &&t : terms) {
+            if (t.coefficient == 0) {
+                continue;
+            }
+            Symbol base = t.scale == 1 ? t.symbol : t.base();
+            double c = std::abs(t.coefficient);
+            (t.coefficient > 0 ? positives : negatives).push_back(c == 1 ? base : make_symbol<MulFunction>(Symbol(c), base));
         }
+        if (negatives.empty()) {
+            return sum(positives);
+        }
+        return make_symbol<SubFunction>(sum(positives), sum(negatives));
     }
 
-    bool canBeSimplified() const {
-        for (auto &&p : positives) {
-            for (auto &&n : negatives) {
-                if (p == n) {
-                    return true;
+ private:
+    struct Term {
+        std::vector<int> key;  // the operands of a product, the term itself otherwise
+        Symbol symbol;
+        double scale;  // constant factor of symbol
+        double coefficient;
+
+        // symbol without its constant factor
+        Symbol base() const {
+            std::vector<Symbol> factors;
+            for (auto &&a : symbol->ptr<MulFunction>()->operands()) {
+                if (not is_constant(a)) {
+                    factors.push_back(a);
+                }
+            }
+            return product(factors);
+        }
+    };
+
+    bool mergeLikeTerms() {
+        std::sort(terms.begin(), terms.end(), [](const Term &lhs, const Term &rhs) { return lhs.key < rhs.key; });
+        bool merged = false;
+        std::vector<Term> result;
+        for (auto &&t : terms) {
+            if (result.size() and result.back().key == t.key) {
+                Term &r = result.back();
+                r.coefficient += t.coefficient;
+                if (t.scale == 1) {
+                    // the term without a constant factor is the base itself
+                    r.symbol = t.symbol;
+                    r.scale = 1;
                 }
+                merged = true;
+            } else {
+                result.push_back(t);
             }
         }
-        return (constants.size() + negative_constants.size()) > 1;
+        terms.swap(result);
+        return merged;
     }
 
-    Symbol simplified() const {
-        std::vector<bool> used(negatives.size(), false);
-        double v = 0;
-        for (auto &&c : constants) {
-            v += c.eval();
+    // id of a if id is f(a)^2 with f of op, -1 otherwise
+    static int squaredArgument(int id, OpCode op) {
+        if (FactoryBase::opcode(id) != OpCode::POW or
+            static_cast<const PowFunction*>(FactoryBase::function(id))->chainExponent() != 2) {
+            return -1;
+        }
+        int base = FactoryBase::alias(FactoryBase::children(id)[0]);
+        return FactoryBase::opcode(base) == op ? FactoryBase::alias(FactoryBase::children(base)[0]) : -1;
+    }
+
+    // the key without its k-th factor
+    static std::vector<int> cofactor(const std::vector<int> &key, size_t k) {
+        std::vector<int> rest(key);
+        rest.erase(rest.begin() + k);
+        return rest;
+    }
+
+    // replaces the pairs c*r*sin(a)^2 and c*r*cos(a)^2 by c*r
+    bool mergePythagorean() {
+        std::map<std::tuple<std::vector<int>, int>, size_t> sines;
+        for (size_t i = 0; i < terms.size(); i++) {
+            for (size_t k = 0; k < terms[i].key.size(); k++) {
+                int a = squaredArgument(terms[i].key[k], OpCode::SIN);
+                if (a >= 0) {
+                    sines.emplace(std::make_tuple(cofactor(terms[i].key, k), a), i);
+                }
+            }
         }
-        for (auto &&c : negative_constants) {
-            v -= c.eval();
+        if (sines.empty()) {
+            return false;
         }
-        Symbol s(v);
-        for (auto &&p : positives) {
-            bool found = false;
-            for (size_t i = 0; i < negatives.size(); i++) {
-                if (used[i]) {
+        bool merged = false;
+        for (size_t j = 0; j < terms.size(); j++) {
+            for (size_t k = 0; k < terms[j].key.size(); k++) {
+                int a = squaredArgument(terms[j].key[k], OpCode::COS);
+                if (a < 0) {
                     continue;
                 }
-                if (p == negatives[i]) {
-                    used[i] = true;
-                    found = true;
-                    break;
+                std::vector<int> rest = cofactor(terms[j].key, k);
+                auto it = sines.find(std::make_tuple(rest, a));
+                if (it == sines.end()) {
+                    continue;
                 }
+                Term &t = terms[it->second];
+                double c = terms[j].coefficient;
+                if (c == 0 or t.coefficient != c) {
+                    continue;
+                }
+                t.coefficient = 0;
+                terms[j].coefficient = 0;
+                sines.erase(it);
+                if (rest.empty()) {
+                    constant += c;
+                    num_constants++;
+                } else {
+                    std::vector<Symbol> factors;
+                    for (auto &&id : rest) {
+                        factors.push_back(Symbol::fromId(id));
+                    }
+                    terms.push_back(Term{rest, product(factors), 1, c});
+                }
+                merged = true;
+                break;
             }
-            if (found) {
-                continue;
-            }
-            s += p;
         }
-        for (size_t i = 0; i < negatives.size(); i++) {
-            if (used[i]) {
-                continue;
+        return merged;
+    }
+
+    void add(Symbol s, double sign) {
+        if (s->is<AddFunction>()) {
+            for (auto &&a : s->ptr<AddFunction>()->operands()) {
+                add(a, sign);
+            }
+        } else if (s->is<SubFunction>()) {
+            SubFunction *p = s->ptr<SubFunction>();
+            add(p->arg0, sign);
+            add(p->arg1, -sign);
+        } else if (s->is<NegFunction>()) {
+            add(s->ptr<NegFunction>()->arg, -sign);
+        } else if (s->is<Constant>()) {
+            constant += sign * s.eval();
+            num_constants++;
+        } else {
+            Term t{{}, s, 1, sign};
+            if (s->is<MulFunction>()) {
+                for (auto &&a : s->ptr<MulFunction>()->operands()) {
+                    if (is_constant(a)) {
+                        t.scale *= a.eval();
+                    } else {
+                        t.key.push_back(a->id());
+                    }
+                }
+                t.coefficient *= t.scale;
+            } else {
+                t.key.push_back(s->id());
             }
-            s -= negatives[i];
+            terms.push_back(std::move(t));
         }
-        return s;
     }
 
-    std::vector<Symbol> positives, negatives;
-    std::vector<Symbol> constants, negative_constants;
+ private:
+    std::vector<Term> terms;
+    double constant = 0;
+    int num_constants = 0;
 };
 
 }  // namespace sym
@@ -9,33 +9,137 @@
 #define BINARY_FUNCTION_HPP_
 
 #include <cmath>
+#include <vector>
+#include <algorithm>
 
 #include "function.hpp"
+#include "cxx_code_printer.hpp"
 
 namespace sym {
 
 class BinaryFunction : public Function {
  public:
-    BinaryFunction(const std::string &operator_, const Symbol &arg0_, const Symbol &arg1_)
-        : Function(_repr("(", arg0_->id(), operator_, arg1_->id(), ")"), {arg0_->id(), arg1_->id()}),
-          arg0(arg0_),
-          arg1(arg1_) {}
+    BinaryFunction(OpCode op_, const char *operator_, const Symbol &arg0_, const Symbol &arg1_)
+        : Function(op_), token(operator_), arg0(arg0_), arg1(arg1_) {}
 
  protected:
+    virtual NodeKey key() const override { return {_op, {arg0->id(), arg1->id()}, 0, ""}; }
+    virtual Repr reprTemplate() const override { return _repr("(", arg0->id(), token, arg1->id(), ")"); }
+
+ protected:
+    const char *token;
     Symbol arg0, arg1;
 };
 
+/**
+ * associative and commutative operation over any number of operands.
+ * operands of the same kind are spliced into the node and all operands are
+ * kept sorted, so a+b+c, c+(a+b) and (c+a)+b are one node.
+ */
+class NaryFunction : public Function {
+ public:
+    NaryFunction(OpCode op_, const char *operator_, const std::vector<Symbol> &args_)
+        : Function(op_), token(operator_), args(flatten(op_, args_)) {}
+
+    const std::vector<Symbol> &operands() const { return args; }
+
+ protected:
+    virtual NodeKey key() const override {
+        NodeKey k{_op, {}, 0, ""};
+        k.args.reserve(args.size());
+        for (auto &&a : args) {
+            k.args.push_back(a->id());
+        }
+        return k;
+    }
+    virtual Repr reprTemplate() const override {
+        Repr r = _repr("(");
+        for (size_t i = 0; i < args.size(); i++) {
+            if (i > 0) {
+                r.items.emplace_back(token);
+            }
+            r.items.emplace_back(args[i]->id());
+        }
+        r.items.emplace_back(")");
+        return r;
+    }
+
+    std::vector<Symbol> subsArgs(const std::map<Symbol, Symbol> &m) const {
+        std::vector<Symbol> result;
+        for (auto &&a : args) {
+            result.push_back(a->subs(m));
+        }
+        return result;
+    }
+
+    // the operands of a nested node are already sorted, so the usual
+    // binary construction is a linear merge of two sorted runs
+    static std::vector<Symbol> flatten(OpCode op, const std::vector<Symbol> &operands) {
+        std::vector<Symbol> result;
+        size_t first_run = 0;
+        for (auto &&s : operands) {
+            if (FactoryBase::opcode(s->id()) == op) {
+                const NaryFunction *p = static_cast<const NaryFunction*>(FactoryBase::function(s->id()));
+                result.insert(result.end(), p->args.begin(), p->args.end());
+            } else {
+                result.push_back(s);
+            }
+            if (first_run == 0) {
+                first_run = result.size();
+            }
+        }
+        if (operands.size() == 2) {
+            std::inplace_merge(result.begin(), result.begin() + first_run, result.end(), before);
+        } else {
+            std::stable_sort(result.begin(), result.end(), before);
+        }
+        return result;
+    }
+
+    // constants first, as they are printed in front, then by id
+    static bool before(const Symbol &lhs, const Symbol &rhs) {
+        bool c0 = FactoryBase::opcode(lhs->id()) == OpCode::CONSTANT;
+        bool c1 = FactoryBase::opcode(rhs->id()) == OpCode::CONSTANT;
+        return c0 != c1 ? c0 : lhs < rhs;
+    }
+
+ protected:
+    const char *token;
+    std::vector<Symbol> args;
+};
+
+// an empty sum is zero, an empty product is one and a single term is returned as is
+inline Symbol sum(const std::vector<Symbol> &terms);
+inline Symbol product(const std::vector<Symbol> &terms);
+
 class ASExtractor;
-class AddFunction : public BinaryFunction {
+class AddFunction : public NaryFunction {
  public:
-    AddFunction(const Symbol &arg0, const Symbol &arg1) : BinaryFunction("+", arg0, arg1) {}
+    static constexpr OpCode opcode = OpCode::ADD;
+
+    AddFunction(const Symbol &arg0, const Symbol &arg1) : NaryFunction(opcode, "+", {arg0, arg1}) {}
+    explicit AddFunction(const std::vector<Symbol> &args_) : NaryFunction(opcode, "+", args_) {}
     virtual void simplified() const override;
-    virtual double eval() const override { return arg0->eval() + arg1->eval(); }
-    virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<AddFunction>(arg0->subs(m), arg1->subs(m)); }
+    virtual double eval() const override {
+        double v = 0;
+        for (auto &&a : args) {
+            v += a->eval();
+        }
+        return v;
+    }
+    virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<AddFunction>(subsArgs(m)); }
+    virtual Symbol partial(int) const override { return one(); }
 
  protected:
     virtual Symbol _diff(Symbol v) const override {
-        return make_symbol<AddFunction>(arg0->diff(v), arg1->diff(v));
+        std::vector<Symbol> terms;
+        for (auto &&a : args) {
+            Symbol d = a->diff(v);
+            if (not is_zero(d)) {
+                terms.push_back(d);
+            }
+        }
+        return sum(terms);
     }
 
     friend class ASExtractor;
@@ -43,10 +147,13 @@ class AddFunction : public BinaryFunction {
 
 class SubFunction : public BinaryFunction {
  public:
-    SubFunction(const Symbol &arg0, const Symbol &arg1) : BinaryFunction("-", arg0, arg1) {}
+    static constexpr OpCode opcode = OpCode::SUB;
+
+    SubFunction(const Symbol &arg0, const Symbol &arg1) : BinaryFunction(opcode, "-", arg0, arg1) {}
     virtual void simplified() const override;
     virtual double eval() const override { return arg0->eval() - arg1->eval(); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<SubFunction>(arg0->subs(m), arg1->subs(m)); }
+    virtual Symbol partial(int index) const override { return index == 0 ? one() : negative_one(); }
 
  protected:
     virtual Symbol _diff(Symbol v) const override {
@@ -57,28 +164,61 @@ class SubFunction : public BinaryFunction {
 };
 
 class MDExtractor;
-class MulFunction : public BinaryFunction {
+class MulFunction : public NaryFunction {
  public:
-    MulFunction(const Symbol &arg0, const Symbol &arg1) : BinaryFunction("*", arg0, arg1) {}
+    static constexpr OpCode opcode = OpCode::MUL;
+
+    MulFunction(const Symbol &arg0, const Symbol &arg1) : NaryFunction(opcode, "*", {arg0, arg1}) {}
+    explicit MulFunction(const std::vector<Symbol> &args_) : NaryFunction(opcode, "*", args_) {}
     virtual void simplified() const override;
-    virtual double eval() const override { return arg0->eval() * arg1->eval(); }
-    virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<MulFunction>(arg0->subs(m), arg1->subs(m)); }
+    virtual double eval() const override {
+        double v = 1;
+        for (auto &&a : args) {
+            v *= a->eval();
+        }
+        return v;
+    }
+    virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<MulFunction>(subsArgs(m)); }
+    // product of the other operands
+    virtual Symbol partial(int index) const override {
+        std::vector<Symbol> others(args);
+        others.erase(others.begin() + index);
+        return product(others);
+    }
 
  protected:
     virtual Symbol _diff(Symbol v) const override {
-        return make_symbol<AddFunction>(make_symbol<MulFunction>(arg0->diff(v), arg1),
-                                        make_symbol<MulFunction>(arg0, arg1->diff(v)));
+        std::vector<Symbol> terms;
+        for (size_t k = 0; k < args.size(); k++) {
+            Symbol d = args[k]->diff(v);
+            if (is_zero(d)) {
+                continue;
+            }
+            std::vector<Symbol> factors(args);
+            factors[k] = d;
+            terms.push_back(product(factors));
+        }
+        return sum(terms);
     }
     friend class MDExtractor;
 };
 
 class DivFunction : public BinaryFunction {
  public:
-    DivFunction(const Symbol &arg) : BinaryFunction("/", one(), arg) {}
+    static constexpr OpCode opcode = OpCode::DIV;
+
+    DivFunction(const Symbol &arg) : BinaryFunction(opcode, "/", one(), arg) {}
 
     virtual void simplified() const override;
     virtual double eval() const override { return 1 / arg1->eval(); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<DivFunction>(arg1->subs(m)); }
+    // arg0 is the constant one
+    virtual Symbol partial(int index) const override {
+        if (index == 0) {
+            return zero();
+        }
+        return make_symbol<MulFunction>(negative_one(), make_symbol<DivFunction>(make_symbol<MulFunction>(arg1, arg1)));
+    }
 
  protected:
     virtual Symbol _diff(Symbol v) const override {
@@ -95,7 +235,9 @@ class DivFunction : public BinaryFunction {
 
 class Atan2Function : public BinaryFunction {
  public:
-    Atan2Function(const Symbol &arg0_, const Symbol &arg1_) : BinaryFunction("atan2", arg0_, arg1_) {}
+    static constexpr OpCode opcode = OpCode::ATAN2;
+
+    Atan2Function(const Symbol &arg0_, const Symbol &arg1_) : BinaryFunction(opcode, "atan2", arg0_, arg1_) {}
     virtual void simplified() const override {
         arg0->simplified();
         arg1->simplified();
@@ -106,20 +248,100 @@ class Atan2Function : public BinaryFunction {
     }
     virtual double eval() const override { return std::atan2(arg0->eval(), arg1->eval()); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<Atan2Function>(arg0->subs(m), arg1->subs(m)); }
+    virtual Symbol partial(int index) const override {
+        Symbol d = make_symbol<DivFunction>(
+            make_symbol<AddFunction>(
+                make_symbol<MulFunction>(arg0, arg0),
+                make_symbol<MulFunction>(arg1, arg1)));
+        if (index == 0) {
+            return make_symbol<MulFunction>(arg1, d);
+        }
+        return make_symbol<MulFunction>(make_symbol<NegFunction>(arg0), d);
+    }
 
  protected:
     virtual Symbol _diff(Symbol v) const override {
         // return (f0->diff(var_id) * f1 - f0 * f1->diff(var_id)) / (f0 * f0 + f1 * f1);
-        return make_symbol<SubFunction>(
-            make_symbol<MulFunction>(arg0->diff(v), arg1),
-            make_symbol<MulFunction>(make_symbol<MulFunction>(arg0, arg1->diff(v)),
-                                     make_symbol<DivFunction>(
-                                         make_symbol<AddFunction>(
-                                             make_symbol<MulFunction>(arg0, arg0),
-                                             make_symbol<MulFunction>(arg1, arg1)))));
+        return make_symbol<MulFunction>(
+            make_symbol<SubFunction>(
+                make_symbol<MulFunction>(arg0->diff(v), arg1),
+                make_symbol<MulFunction>(arg0, arg1->diff(v))),
+            make_symbol<DivFunction>(
+                make_symbol<AddFunction>(
+                    make_symbol<MulFunction>(arg0, arg0),
+                    make_symbol<MulFunction>(arg1, arg1))));
     }
 };
 
+/**
+ * arg0 to the power of arg1. an integer exponent up to max_chain_exponent
+ * is printed as a chain of multiplications, up to x^3 inline and above by
+ * the static member _pow<n> that CxxCodePrinter adds to the generated class,
+ * any other exponent is printed as pow.
+ */
+class PowFunction : public BinaryFunction {
+ public:
+    static constexpr OpCode opcode = OpCode::POW;
+
+    PowFunction(const Symbol &arg0_, const Symbol &arg1_) : BinaryFunction(opcode, "pow", arg0_, arg1_) {}
+    virtual void simplified() const override;
+    virtual double eval() const override { return std::pow(arg0->eval(), arg1->eval()); }
+    virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<PowFunction>(arg0->subs(m), arg1->subs(m)); }
+    virtual Symbol partial(int index) const override;
+
+    // exponent of the chain of multiplications x^n is printed with, 0 if it is printed as pow
+    int chainExponent() const {
+        if (not is_constant(arg1)) {
+            return 0;
+        }
+        double e = arg1->eval();
+        if (e != std::floor(e) or std::abs(e) > max_chain_exponent) {
+            return 0;
+        }
+        return static_cast<int>(e);
+    }
+
+ protected:
+    virtual Symbol _diff(Symbol v) const override;
+    virtual Repr reprTemplate() const override {
+        int n = chainExponent();
+        if (n == 0) {
+            return _repr("pow(", arg0->id(), ", ", arg1->id(), ")");
+        }
+        Repr r;
+        if (std::abs(n) <= 3) {
+            r = _repr("(", arg0->id());
+            for (int k = 1; k < std::abs(n); k++) {
+                r.items.emplace_back("*");
+                r.items.emplace_back(arg0->id());
+            }
+            r.items.emplace_back(")");
+        } else {
+            r = _repr("_pow" + std::to_string(std::abs(n)) + "(", arg0->id(), ")");
+        }
+        if (n < 0) {
+            r.items.insert(r.items.begin(), Repr::Item("(1.0/"));
+            r.items.emplace_back(")");
+        }
+        return r;
+    }
+    friend class MDExtractor;
+};
+
+inline Symbol sum(const std::vector<Symbol> &terms) {
+    if (terms.empty()) {
+        return zero();
+    }
+    return terms.size() == 1 ? terms[0] : make_symbol<AddFunction>(terms);
+}
+
+inline Symbol product(const std::vector<Symbol> &terms) {
+    if (terms.empty()) {
+        return one();
+    }
+    return terms.size() == 1 ? terms[0] : make_symbol<MulFunction>(terms);
+}
+
 Symbol operator+(const Symbol &arg0, const Symbol &arg1) {
     return make_symbol<AddFunction>(arg0, arg1);
 }
@@ -171,6 +393,14 @@ Symbol operator/(const Symbol &arg0, const double &arg1) {
                                     make_symbol<DivFunction>(make_symbol<Constant>(arg1)));
 }
 
+inline Symbol pow(const Symbol &arg0, const Symbol &arg1) {
+    return make_symbol<PowFunction>(arg0, arg1);
+}
+
+inline Symbol pow(const Symbol &arg0, const double &arg1) {
+    return make_symbol<PowFunction>(arg0, make_symbol<Constant>(arg1));
+}
+
 }  // namespace sym
 
 #endif  // BINARY_FUNCTION_HPP_
@@ -16,26 +16,17 @@
 namespace sym {
 
 inline void AddFunction::simplified() const  {
-    if (is_zero(arg0)) {
-        FactoryBase::setAliasRepr(id(), arg1->id());
-    } else if (is_zero(arg1)) {
-        FactoryBase::setAliasRepr(id(), arg0->id());
-    } else if (is_constant(arg0) and is_constant(arg1)) {
-        auto a = make_symbol<Constant>(arg0.eval() + arg1.eval());
-        FactoryBase::setAliasRepr(id(), a->id());
-    } else if (is_constant(arg1)) {
-        auto a = make_symbol<AddFunction>(arg1, arg0);
+    if (args.size() < 2) {
+        FactoryBase::setAliasRepr(id(), sum(args)->id());
+        return;
+    }
+    ASExtractor ex;
+    for (auto &&a : args) {
+        ex.addAdd(a);
+    }
+    if (ex.canBeSimplified()) {
+        auto a = ex.simplified();
         FactoryBase::setAliasRepr(id(), a->id());
-    } else {
-        // arg0->simplified();
-        // arg1->simplified();
-        ASExtractor ex;
-        ex.addAdd(arg0);
-        ex.addAdd(arg1);
-        if (ex.canBeSimplified()) {
-            auto a = ex.simplified();
-            FactoryBase::setAliasRepr(id(), a->id());
-        }
     }
 }
 
@@ -66,38 +57,24 @@ inline void SubFunction::simplified() const {
 }
 
 inline void MulFunction::simplified() const  {
-    // arg0->simplified();
-    // arg1->simplified();
-    if (is_zero(arg0) or is_zero(arg1)) {
-        FactoryBase::setAliasRepr(id(), zero()->id());
-    } else if (is_one(arg0)) {
-        FactoryBase::setAliasRepr(id(), arg1->id());
-    } else if (is_one(arg1)) {
-        FactoryBase::setAliasRepr(id(), arg0->id());
-    } else if (is_constant(arg0) and is_constant(arg1)) {
-        Symbol a(arg0->eval() * arg1->eval());
-        FactoryBase::setAliasRepr(id(), a->id());
-    } else if (is_negative_one(arg0)) {
-        auto a = make_symbol<NegFunction>(arg1);
-        FactoryBase::setAliasRepr(id(), a->id());
-    } else if (is_negative_one(arg0)) {
-        auto a = make_symbol<NegFunction>(arg0);
-        FactoryBase::setAliasRepr(id(), a->id());
-    } else if (is_constant(arg0) and is_constant(arg1)) {
-        auto a = make_symbol<Constant>(arg0.eval() * arg1.eval());
-        FactoryBase::setAliasRepr(id(), a->id());
-    } else if (is_constant(arg1)) {
-        auto a = make_symbol<MulFunction>(arg1, arg0);
-        FactoryBase::setAliasRepr(id(), a->id());
-    } else {
-        MDExtractor mx;
-        mx.addMul(arg0);
-        mx.addMul(arg1);
-        if (mx.canBeSimplified()) {
-            auto a = mx.simplified();
-            FactoryBase::setAliasRepr(id(), a->id());
+    if (args.size() < 2) {
+        FactoryBase::setAliasRepr(id(), product(args)->id());
+        return;
+    }
+    for (auto &&a : args) {
+        if (is_zero(a)) {
+            FactoryBase::setAliasRepr(id(), zero()->id());
+            return;
         }
     }
+    MDExtractor mx;
+    for (auto &&a : args) {
+        mx.addMul(a);
+    }
+    if (mx.canBeSimplified()) {
+        auto a = mx.simplified();
+        FactoryBase::setAliasRepr(id(), a->id());
+    }
 }
 
 void DivFunction::simplified() const  {
@@ -117,6 +94,44 @@ void DivFunction::simplified() const  {
     }
 }
 
+inline void PowFunction::simplified() const {
+    if (is_constant(arg0) and is_constant(arg1)) {
+        auto a = make_symbol<Constant>(std::pow(arg0->eval(), arg1->eval()));
+        FactoryBase::setAliasRepr(id(), a->id());
+    } else if (is_zero(arg1)) {
+        FactoryBase::setAliasRepr(id(), one()->id());
+    } else if (is_one(arg1)) {
+        FactoryBase::setAliasRepr(id(), arg0->id());
+    } else if (is_negative_one(arg1)) {
+        auto a = make_symbol<DivFunction>(arg0);
+        FactoryBase::setAliasRepr(id(), a->id());
+    } else if (is_constant(arg1) and arg0->is<PowFunction>() and chainExponent() != 0) {
+        // (b^a)^n = b^(a n) holds for an integer n only
+        PowFunction *p = arg0->ptr<PowFunction>();
+        auto a = make_symbol<PowFunction>(p->arg0, make_symbol<MulFunction>(p->arg1, arg1));
+        FactoryBase::setAliasRepr(id(), a->id());
+    }
+}
+
+inline Symbol PowFunction::partial(int index) const {
+    if (index == 0) {
+        return make_symbol<MulFunction>(arg1, make_symbol<PowFunction>(arg0, make_symbol<AddFunction>(arg1, negative_one())));
+    }
+    return make_symbol<MulFunction>(self(), make_symbol<LogFunction>(arg0));
+}
+
+inline Symbol PowFunction::_diff(Symbol v) const {
+    Symbol d0 = arg0->diff(v), d1 = arg1->diff(v);
+    std::vector<Symbol> terms;
+    if (not is_zero(d0)) {
+        terms.push_back(make_symbol<MulFunction>(partial(0), d0));
+    }
+    if (not is_zero(d1)) {
+        terms.push_back(make_symbol<MulFunction>(partial(1), d1));
+    }
+    return sum(terms);
+}
+
 }  // namespace sym
 
 
@@ -9,38 +9,41 @@
 #define CALCULATION_GRAPH_HPP_
 
 #include <algorithm>
+#include <unordered_set>
 #include "factory_base.hpp"
 
 namespace sym {
 
 class CalculationGraph {
  public:
+    // ids past id_mapping are nodes of a print layout, see Factory::printLayout
     CalculationGraph(const std::unordered_map<int, std::string> &input_nodes_,
                      const std::unordered_map<std::string, int> &output_nodes_,
                      const std::vector<Repr> &repr_list_,
-                     const std::vector<std::unordered_set<int>> &depends_list,
+                     const ChildTable &children,
                      const std::vector<int> &id_mapping) : input_nodes(input_nodes_), repr_list(repr_list_) {
         std::vector<int> depths(repr_list_.size(), -1);
         std::vector<std::tuple<int, int>> stack;
+        auto resolve = [&](int id) { return id < static_cast<int>(id_mapping.size()) ? id_mapping[id] : id; };
         
         for (auto &&[key, value] : input_nodes_) {
             repr_list[key] = _repr(value);
         }
         for (size_t i = 0; i < id_mapping.size(); i++) {
             if ((int)i != id_mapping[i]) {
-                repr_list[i] = repr_list[id_mapping[i]];
+                repr_list[i] = _repr(id_mapping[i]);
             }
         }
 
         for (auto &&[value, key] : output_nodes_) {
             // std::cout << "[output] key=" << id_mapping[key] << ", value = " << value << std::endl;
-            output_nodes[value] = id_mapping[key];
-            stack.emplace_back(0, id_mapping[key]);
+            output_nodes[value] = resolve(key);
+            stack.emplace_back(0, resolve(key));
         }
 
         std::vector<int> counts(repr_list_.size(), 0);
-        for (auto &&dl : depends_list) {
-            for (auto &&d : dl) {
+        for (size_t i = 0; i < children.size(); i++) {
+            for (auto &&d : children[i]) {
                 counts[d]++;
             }
         }
@@ -52,8 +55,8 @@ class CalculationGraph {
             stack.pop_back();
 
             depth += 1;
-            for (auto &&dkey_ : depends_list[key]) {
-                int dkey = id_mapping[dkey_];
+            for (auto &&dkey_ : children[key]) {
+                int dkey = resolve(dkey_);
                 // std::cout << key << "(" << FactoryBase::repr(key) << ")" << " -> " << dkey << "(" << FactoryBase::repr(dkey) << ")" << std::endl;
                 if (depths[dkey] >= depth) {
                     continue;
@@ -79,7 +82,7 @@ class CalculationGraph {
         }
         std::sort(test_order.begin(), test_order.end());
         for (auto &&[depth, key] : test_order) {
-            if (FactoryBase::is<Constant>(key)) {
+            if (key < static_cast<int>(id_mapping.size()) and FactoryBase::is<Constant>(key)) {
                 continue;
             }
             // std::cout << "key=" << key << ", depth=" << depth << std::endl;
@@ -95,15 +98,48 @@ class CalculationGraph {
         std::reverse(output_order.begin(), output_order.end());
     }
 
+    // sin(a) and cos(a), given as (a, sin, cos), are printed as one _sincos call when both are computed here,
+    // see CxxCodePrinter::sinCosFunctions for when it is a single call of the math library
+    void fuseSinCos(const std::vector<std::tuple<int, int, int>> &pairs) {
+        for (auto &&p : pairs) {
+            sincos_pairs[std::get<1>(p)] = p;
+            sincos_pairs[std::get<2>(p)] = p;
+        }
+    }
+
     friend std::ostream &operator<<(std::ostream &os, const CalculationGraph &g) {
-        std::vector<Repr> cur_repr_list = g.repr_list;
+        ReprRenderer renderer(g.repr_list);
+        std::unordered_set<int> computed, printed;
+        for (auto &&item : g.output_order) {
+            computed.insert(std::get<2>(item));
+        }
         for (auto &&[dtype, dvar, key] : g.output_order) {
+            if (printed.count(key)) {
+                continue;
+            }
+            auto it = g.sincos_pairs.find(key);
+            if (it != g.sincos_pairs.end()) {
+                auto [arg, s, c] = it->second;
+                if (computed.count(s) and computed.count(c)) {
+                    // the argument is deeper than both, so it is already printed
+                    std::string vs = g.tvar + std::to_string(s), vc = g.tvar + std::to_string(c);
+                    os << g.line_prefix << g.tvar_type << " " << vs << ", " << vc << ";" << std::endl;
+                    // converted so that the overload of IntermediateScalar is called for inputs of ProbeScalar
+                    os << g.line_prefix << "_sincos(" << g.tvar_type << "(" << renderer(arg) << "), " << vs << ", " << vc
+                       << ");" << std::endl;
+                    renderer.assign(s, vs);
+                    renderer.assign(c, vc);
+                    printed.insert(s);
+                    printed.insert(c);
+                    continue;
+                }
+            }
             std::string dv = dtype == "" ? dvar : dtype + " " + dvar;
-            os << g.line_prefix << dv << " = " << cur_repr_list[key](cur_repr_list) << ";" << std::endl;
-            cur_repr_list[key] = _repr(dvar);
+            os << g.line_prefix << dv << " = " << renderer(key) << ";" << std::endl;
+            renderer.assign(key, dvar);
         }
         for (auto &&[value, key] : g.output_nodes) {
-            os << g.line_prefix << value << " = " << cur_repr_list[key](cur_repr_list) << ";" << std::endl;
+            os << g.line_prefix << value << " = " << renderer(key) << ";" << std::endl;
         }
         return os;
     }
@@ -114,6 +150,7 @@ class CalculationGraph {
     std::unordered_map<std::string, int> output_nodes;
     std::vector<Repr> repr_list;
     std::vector<std::tuple<std::string, std::string, int>> output_order;
+    std::unordered_map<int, std::tuple<int, int, int>> sincos_pairs;
 };
 
 }  // namespace sym
@@ -8,13 +8,61 @@
 #ifndef CXX_CODE_PRINTER_HPP_
 #define CXX_CODE_PRINTER_HPP_
 
+#include <set>
+#include <string>
+#include <stdexcept>
+#include <tuple>
 #include <ostream>
 #include <vector>
 
 namespace sym {
 
+// larger integer exponents are printed as pow instead of a chain of multiplications
+constexpr int max_chain_exponent = 1024;
+
+/**
+ * shortest addition chain 1 = a_0 < a_1 < ... < a_r = n, every element is
+ * the sum of the previous one and an earlier one, so x^n takes r
+ * multiplications. such star chains are optimal for n < 12509, they are found
+ * by iterative deepening for n up to max_chain_exponent.
+ */
+inline std::vector<int> addition_chain(int n) {
+    if (n < 1 or n > max_chain_exponent) {
+        throw std::runtime_error("no addition chain for the exponent " + std::to_string(n));
+    }
+    std::vector<int> chain{1};
+    auto search = [n, &chain](auto &&self, size_t length) -> bool {
+        if (chain.back() == n) {
+            return true;
+        }
+        if (chain.size() > length or (static_cast<long>(chain.back()) << (length + 1 - chain.size())) < n) {
+            return false;
+        }
+        for (size_t j = chain.size(); j-- > 0;) {
+            int next = chain.back() + chain[j];
+            if (next > n) {
+                continue;
+            }
+            chain.push_back(next);
+            if (self(self, length)) {
+                return true;
+            }
+            chain.pop_back();
+        }
+        return false;
+    };
+    size_t length = 1;
+    while (not search(search, length)) {
+        length++;
+    }
+    return chain;
+}
+
 class CxxCodePrinter {
  public:
+    // bump when the printed code changes, cached outputs of older versions are regenerated
+    static constexpr int format_version = 4;
+
     class CxxFunction {
      public:
         CxxFunction() {}
@@ -66,6 +114,63 @@ class CxxCodePrinter {
         f.contents = refresh_contents;
     }
 
+    /**
+     * pattern of a sparse output as static constexpr CSR (row_offsets, col_indices)
+     * and COO (row_indices, col_indices) arrays. a compressed output also gets
+     * the column colors and, for each nonzero, its index in the output.
+     */
+    void addSparsePattern(const std::string &symbol, int rows, int cols,
+                          const std::vector<int> &row_offsets, const std::vector<int> &col_indices,
+                          int num_colors = 0, const std::vector<int> &colors = {}) {
+        auto join = [](const std::vector<int> &values) {
+            std::string result;
+            for (auto &&v : values) {
+                result += (result == "" ? "" : ", ") + std::to_string(v);
+            }
+            return result;
+        };
+        std::vector<int> row_indices;
+        for (int r = 0; r < rows; r++) {
+            row_indices.insert(row_indices.end(), row_offsets[r + 1] - row_offsets[r], r);
+        }
+        size_t nnz = col_indices.size();
+        static_members.push_back("int " + symbol + "_rows = " + std::to_string(rows));
+        static_members.push_back("int " + symbol + "_cols = " + std::to_string(cols));
+        static_members.push_back("int " + symbol + "_nnz = " + std::to_string(nnz));
+        static_members.push_back("int " + symbol + "_row_offsets[" + std::to_string(rows + 1) + "] = {" + join(row_offsets) + "}");
+        if (nnz > 0) {
+            static_members.push_back("int " + symbol + "_row_indices[" + std::to_string(nnz) + "] = {" + join(row_indices) + "}");
+            static_members.push_back("int " + symbol + "_col_indices[" + std::to_string(nnz) + "] = {" + join(col_indices) + "}");
+        }
+        if (colors.size()) {
+            std::vector<int> compressed_indices;
+            for (size_t k = 0; k < nnz; k++) {
+                compressed_indices.push_back(row_indices[k] * num_colors + colors[col_indices[k]]);
+            }
+            static_members.push_back("int " + symbol + "_num_colors = " + std::to_string(num_colors));
+            static_members.push_back("int " + symbol + "_colors[" + std::to_string(cols) + "] = {" + join(colors) + "}");
+            if (nnz > 0) {
+                static_members.push_back("int " + symbol + "_compressed_indices[" + std::to_string(nnz) + "] = {" +
+                                         join(compressed_indices) + "}");
+            }
+        }
+    }
+
+    // printed after operator()
+    void addFunction(const CxxFunction &f) {
+        function_list.push_back(f);
+    }
+
+    // the static member _pow<n>(x) = x^n, a chain of multiplications
+    void addPowerFunction(int n) {
+        powers.insert(n);
+    }
+
+    // the static members _sincos(x, s, c), sin and cos of the same argument evaluated together by one call
+    void addSinCosFunction() {
+        sin_cos = true;
+    }
+
     void setDynamicVariables(const std::vector<std::tuple<bool, std::string>> &variables, const std::string &contents) {
         auto &f = function_list[1];
         f.type = "void";
@@ -83,10 +188,24 @@ class CxxCodePrinter {
         os << "template<class ProbeScalar = double, class IntermediateScalar = double>" << std::endl;
         os << "class " << g.class_name << " {" << std::endl;
         os << " public:" << std::endl;
+        for (auto &&m : g.static_members) {
+            os << "    static constexpr " << m << ";" << std::endl;
+        }
+        if (g.static_members.size()) {
+            os << std::endl;
+        }
         os << g.constructor << std::endl;
         for (auto &&f : g.function_list) {
             os << f << std::endl;
         }
+        for (auto &&n : g.powers) {
+            os << powerFunction(n) << std::endl;
+        }
+        if (g.sin_cos) {
+            for (auto &&f : sinCosFunctions()) {
+                os << f << std::endl;
+            }
+        }
         for (auto &&m : g.members) {
             os << "    " << m << ";" << std::endl;
         }
@@ -95,11 +214,66 @@ class CxxCodePrinter {
         return os;
     }
 
+ protected:
+    static CxxFunction powerFunction(int n) {
+        CxxFunction f;
+        f.type = "static IntermediateScalar";
+        f.name = "_pow" + std::to_string(n);
+        f.args = "const IntermediateScalar &x1";
+        std::vector<int> chain = addition_chain(n);
+        for (size_t i = 1; i < chain.size(); i++) {
+            int a = chain[i - 1], b = chain[i] - chain[i - 1];
+            std::string v = "x" + std::to_string(a) + " * x" + std::to_string(b);
+            if (i + 1 < chain.size()) {
+                f.contents += "        IntermediateScalar x" + std::to_string(chain[i]) + " = " + v + ";\n";
+            } else {
+                f.contents += "        return " + v + ";\n";
+            }
+        }
+        return f;
+    }
+
+    /**
+     * sin and cos of any scalar type. for double and float, gcc and clang
+     * emit one call of sincos or sincosf of the math library when optimizing,
+     * the results go through locals because references to s and c might
+     * alias and keep the call split. otherwise the fusion is left to the
+     * compiler and is best effort
+     */
+    static std::vector<CxxFunction> sinCosFunctions() {
+        CxxFunction generic;
+        generic.type = "template <class T> static void";
+        generic.name = "_sincos";
+        generic.args = "const T &x, T &s, T &c";
+        generic.contents = "        s = sin(x);\n"
+                           "        c = cos(x);\n";
+        std::vector<CxxFunction> result{generic};
+        for (auto &&[type, builtin] : {std::make_tuple("double", "__builtin_sincos"), std::make_tuple("float", "__builtin_sincosf")}) {
+            CxxFunction f;
+            f.type = "static void";
+            f.name = "_sincos";
+            f.args = std::string("const ") + type + " &x, " + type + " &s, " + type + " &c";
+            f.contents = std::string("#if defined(__GNUC__)\n") +
+                         "        " + type + " s_, c_;\n"
+                         "        " + builtin + "(x, &s_, &c_);\n"
+                         "        s = s_;\n"
+                         "        c = c_;\n"
+                         "#else\n"
+                         "        s = sin(x);\n"
+                         "        c = cos(x);\n"
+                         "#endif\n";
+            result.push_back(f);
+        }
+        return result;
+    }
+
  protected:
     std::string ns, class_name;
     CxxFunction constructor;
     std::vector<CxxFunction> function_list;
-    std::vector<std::string> members;
+    std::vector<std::string> members, static_members;
+    std::set<int> powers;
+    bool sin_cos = false;
 };
 
 }  // namespace sym
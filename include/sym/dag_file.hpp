@@ -0,0 +1,431 @@
+/**
+ * Copyright
+ * @file dag_file.hpp
+ * @brief
+ * @author Shogo Sawai
+ * @date 2018-12-07 11:20:48
+ */
+#ifndef DAG_FILE_HPP_
+#define DAG_FILE_HPP_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <list>
+#include <fstream>
+
+#include "function.hpp"
+#include "unary_function.hpp"
+#include "binary_function.hpp"
+#include "factory.hpp"
+
+namespace sym {
+
+/**
+ * layout of a saved graph. every section is a plain array at an 8 byte
+ * aligned offset, so a mapped file is read in place. nodes are stored in
+ * topological order, children always have smaller ids than their parents.
+ */
+struct DagHeader {
+    static constexpr uint32_t current_version = 4;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t num_nodes;
+    uint32_t num_args;
+    uint32_t num_bindings;
+    uint32_t num_binding_nodes;
+    uint32_t strings_size;
+    uint32_t num_pattern_entries;
+    uint32_t reserved;
+    uint64_t opcodes_offset;        // uint8_t[num_nodes]
+    uint64_t payloads_offset;       // uint64_t[num_nodes], bits of a constant or name of a variable
+    uint64_t arg_offsets_offset;    // uint32_t[num_nodes + 1]
+    uint64_t args_offset;           // int32_t[num_args]
+    uint64_t bindings_offset;       // DagBinding[num_bindings]
+    uint64_t binding_nodes_offset;  // int32_t[num_binding_nodes], -1 for an unset output
+    uint64_t strings_offset;        // char[strings_size], zero terminated
+    uint64_t patterns_offset;       // int32_t[num_pattern_entries]
+};
+
+/**
+ * an Input or Output of the saved factory, in registration order
+ */
+struct DagBinding {
+    uint8_t tag;  // IOTag
+    uint8_t is_input;
+    uint8_t is_sparse;
+    uint8_t reserved;
+    uint32_t name;  // offset into strings
+    uint32_t first;  // offset into binding nodes
+    uint32_t size;
+    uint32_t rows, cols;  // of a sparse output
+    uint32_t nnz, num_colors;  // num_colors is 0 unless compressed
+    // offset into patterns, row_offsets[rows + 1], col_indices[nnz] and if compressed, colors[cols]
+    uint32_t pattern;
+};
+
+inline const char *dag_magic() { return "SYMDAG\0"; }
+
+/**
+ * read only view of a saved graph mapped into memory
+ */
+class DagFile {
+ public:
+    explicit DagFile(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0 or static_cast<size_t>(st.st_size) < sizeof(DagHeader)) {
+            ::close(fd);
+            throw std::runtime_error("not a graph file : " + path);
+        }
+        length = st.st_size;
+        data = static_cast<const char*>(::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0));
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("cannot map " + path);
+        }
+        try {
+            check(path);
+        } catch (...) {
+            ::munmap(const_cast<char*>(data), length);
+            throw;
+        }
+    }
+    DagFile(const DagFile &) = delete;
+    DagFile &operator=(const DagFile &) = delete;
+    ~DagFile() { ::munmap(const_cast<char*>(data), length); }
+
+    const DagHeader &header() const { return *reinterpret_cast<const DagHeader*>(data); }
+    size_t size() const { return header().num_nodes; }
+    OpCode opcode(int id) const { return static_cast<OpCode>(section<uint8_t>(header().opcodes_offset)[id]); }
+    ChildTable::Range children(int id) const {
+        const uint32_t *offsets = section<uint32_t>(header().arg_offsets_offset);
+        const int *args = section<int>(header().args_offset);
+        return ChildTable::Range{args + offsets[id], args + offsets[id + 1]};
+    }
+    double constant(int id) const { return from_bits(payload(id)); }
+    const char *name(int id) const { return string(payload(id)); }
+
+    size_t numBindings() const { return header().num_bindings; }
+    const DagBinding &binding(int index) const { return section<DagBinding>(header().bindings_offset)[index]; }
+    const char *bindingName(int index) const { return string(binding(index).name); }
+    const int *bindingNodes(int index) const {
+        return section<int>(header().binding_nodes_offset) + binding(index).first;
+    }
+    const int *bindingPattern(int index) const {
+        return section<int>(header().patterns_offset) + binding(index).pattern;
+    }
+
+ private:
+    template<class T>
+    const T *section(uint64_t offset) const { return reinterpret_cast<const T*>(data + offset); }
+    uint64_t payload(int id) const { return section<uint64_t>(header().payloads_offset)[id]; }
+    const char *string(uint32_t offset) const {
+        if (offset >= header().strings_size) {
+            throw std::runtime_error("broken graph file, string out of range");
+        }
+        return section<char>(header().strings_offset) + offset;
+    }
+
+    // the header, the section bounds, the child offsets and the sparse patterns are checked, node contents are checked while loading
+    void check(const std::string &path) const {
+        const DagHeader &h = header();
+        if (std::memcmp(h.magic, dag_magic(), sizeof(h.magic)) != 0) {
+            throw std::runtime_error("not a graph file : " + path);
+        }
+        if (h.version != DagHeader::current_version) {
+            throw std::runtime_error("unsupported graph file version " + std::to_string(h.version) + " : " + path);
+        }
+        auto within = [this](uint64_t offset, uint64_t count, size_t element_size) {
+            return offset % 8 == 0 and offset <= length and count <= (length - offset) / element_size;
+        };
+        if (not within(h.opcodes_offset, h.num_nodes, sizeof(uint8_t)) or
+            not within(h.payloads_offset, h.num_nodes, sizeof(uint64_t)) or
+            not within(h.arg_offsets_offset, uint64_t(h.num_nodes) + 1, sizeof(uint32_t)) or
+            not within(h.args_offset, h.num_args, sizeof(int32_t)) or
+            not within(h.bindings_offset, h.num_bindings, sizeof(DagBinding)) or
+            not within(h.binding_nodes_offset, h.num_binding_nodes, sizeof(int32_t)) or
+            not within(h.strings_offset, h.strings_size, sizeof(char)) or
+            not within(h.patterns_offset, h.num_pattern_entries, sizeof(int32_t)) or
+            (h.strings_size > 0 and data[h.strings_offset + h.strings_size - 1] != '\0')) {
+            throw std::runtime_error("broken graph file : " + path);
+        }
+        const uint32_t *offsets = section<uint32_t>(h.arg_offsets_offset);
+        if (offsets[0] != 0 or offsets[h.num_nodes] != h.num_args) {
+            throw std::runtime_error("broken graph file : " + path);
+        }
+        // with the bounds above, every range of children lies within args
+        for (size_t i = 0; i < h.num_nodes; i++) {
+            if (offsets[i] > offsets[i + 1]) {
+                throw std::runtime_error("broken graph file : " + path);
+            }
+        }
+        for (size_t i = 0; i < h.num_bindings; i++) {
+            const DagBinding &b = binding(i);
+            if (uint64_t(b.first) + b.size > h.num_binding_nodes or
+                (b.is_sparse and uint64_t(b.pattern) + b.rows + 1 + b.nnz + (b.num_colors ? b.cols : 0) > h.num_pattern_entries) or
+                (b.is_sparse and not validPattern(b))) {
+                throw std::runtime_error("broken graph file : " + path);
+            }
+        }
+    }
+
+    // row offsets run from 0 to nnz without decreasing, column indices are below cols and colors below num_colors
+    bool validPattern(const DagBinding &b) const {
+        const int *row_offsets = section<int>(header().patterns_offset) + b.pattern;
+        const int *col_indices = row_offsets + b.rows + 1;
+        const int *colors = col_indices + b.nnz;
+        uint64_t num_values = b.num_colors ? uint64_t(b.rows) * b.num_colors : b.nnz;
+        if (b.rows > uint32_t(std::numeric_limits<int>::max()) or b.cols > uint32_t(std::numeric_limits<int>::max()) or
+            b.num_colors > b.cols or num_values != b.size or row_offsets[0] != 0 or row_offsets[b.rows] != int64_t(b.nnz)) {
+            return false;
+        }
+        for (size_t r = 0; r < b.rows; r++) {
+            if (row_offsets[r] > row_offsets[r + 1]) {
+                return false;
+            }
+        }
+        for (size_t k = 0; k < b.nnz; k++) {
+            if (col_indices[k] < 0 or uint32_t(col_indices[k]) >= b.cols) {
+                return false;
+            }
+        }
+        for (size_t c = 0; b.num_colors and c < b.cols; c++) {
+            if (colors[c] < 0 or uint32_t(colors[c]) >= b.num_colors) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+ private:
+    const char *data;
+    size_t length;
+};
+
+inline void Factory::save(const std::string &path) const {
+    Scope scope(*this);
+    if (checkpointed_gradients.size()) {
+        throw std::runtime_error("checkpointed gradients can not be saved");
+    }
+
+    std::vector<Binding> bindings = this->bindings();
+    std::vector<int> order = topologicalOrder(bindingNodes(bindings)), index(size(), -1);
+    // id order is topological unless a node is aliased to a newer one. it is
+    // preferred, a loaded factory then numbers the nodes in the same order
+    // and keeps the operand order of sums and products
+    std::vector<int> by_id(order);
+    std::sort(by_id.begin(), by_id.end());
+    for (size_t i = 0; i < by_id.size(); i++) {
+        index[by_id[i]] = i;
+    }
+    bool topological = true;
+    for (size_t i = 0; i < by_id.size() and topological; i++) {
+        for (auto &&c : children(by_id[i])) {
+            topological = topological and index[alias(c)] < static_cast<int>(i);
+        }
+    }
+    if (topological) {
+        order.swap(by_id);
+    }
+    for (size_t i = 0; i < order.size(); i++) {
+        index[order[i]] = i;
+    }
+
+    std::string strings;
+    auto add_string = [&strings](const std::string &s) {
+        uint32_t offset = strings.size();
+        strings += s;
+        strings.push_back('\0');
+        return offset;
+    };
+    std::vector<uint8_t> opcodes_(order.size());
+    std::vector<uint64_t> payloads(order.size(), 0);
+    std::vector<uint32_t> arg_offsets{0};
+    std::vector<int32_t> args;
+    for (size_t i = 0; i < order.size(); i++) {
+        int id = order[i];
+        opcodes_[i] = static_cast<uint8_t>(opcode(id));
+        if (opcode(id) == OpCode::CONSTANT) {
+            payloads[i] = to_bits(value(id));
+        } else if (opcode(id) == OpCode::VARIABLE) {
+            payloads[i] = add_string(repr(id));
+        }
+        for (auto &&c : children(id)) {
+            args.push_back(index[alias(c)]);
+        }
+        arg_offsets.push_back(args.size());
+    }
+    std::vector<DagBinding> dag_bindings;
+    std::vector<int32_t> binding_nodes, patterns;
+    for (auto &&b : bindings) {
+        DagBinding d{static_cast<uint8_t>(b.tag), b.is_input, b.pattern != nullptr, 0, add_string(b.name),
+                     static_cast<uint32_t>(binding_nodes.size()), static_cast<uint32_t>(b.nodes.size()), 0, 0, 0, 0, 0};
+        if (b.pattern) {
+            d.rows = b.pattern->rows;
+            d.cols = b.pattern->cols;
+            d.nnz = b.pattern->nnz();
+            d.num_colors = b.pattern->num_colors;
+            d.pattern = patterns.size();
+            patterns.insert(patterns.end(), b.pattern->row_offsets.begin(), b.pattern->row_offsets.end());
+            patterns.insert(patterns.end(), b.pattern->col_indices.begin(), b.pattern->col_indices.end());
+            patterns.insert(patterns.end(), b.pattern->colors.begin(), b.pattern->colors.end());
+        }
+        dag_bindings.push_back(d);
+        for (auto &&id : b.nodes) {
+            binding_nodes.push_back(id >= 0 ? index[alias(id)] : -1);
+        }
+    }
+
+    DagHeader header{};
+    std::memcpy(header.magic, dag_magic(), sizeof(header.magic));
+    header.version = DagHeader::current_version;
+    header.num_nodes = order.size();
+    header.num_args = args.size();
+    header.num_bindings = dag_bindings.size();
+    header.num_binding_nodes = binding_nodes.size();
+    header.strings_size = strings.size();
+    header.num_pattern_entries = patterns.size();
+    uint64_t offset = sizeof(DagHeader);
+    auto place = [&offset](uint64_t &section_offset, size_t bytes) {
+        offset = (offset + 7) & ~uint64_t(7);
+        section_offset = offset;
+        offset += bytes;
+    };
+    place(header.opcodes_offset, opcodes_.size());
+    place(header.payloads_offset, payloads.size() * sizeof(uint64_t));
+    place(header.arg_offsets_offset, arg_offsets.size() * sizeof(uint32_t));
+    place(header.args_offset, args.size() * sizeof(int32_t));
+    place(header.bindings_offset, dag_bindings.size() * sizeof(DagBinding));
+    place(header.binding_nodes_offset, binding_nodes.size() * sizeof(int32_t));
+    place(header.strings_offset, strings.size());
+    place(header.patterns_offset, patterns.size() * sizeof(int32_t));
+
+    std::ofstream ofs(path, std::ios::binary);
+    if (not ofs) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    uint64_t written = 0;
+    auto write = [&ofs, &written](uint64_t section_offset, const void *p, size_t bytes) {
+        static const char padding[8] = {};
+        ofs.write(padding, section_offset - written);
+        ofs.write(static_cast<const char*>(p), bytes);
+        written = section_offset + bytes;
+    };
+    write(0, &header, sizeof(header));
+    write(header.opcodes_offset, opcodes_.data(), opcodes_.size());
+    write(header.payloads_offset, payloads.data(), payloads.size() * sizeof(uint64_t));
+    write(header.arg_offsets_offset, arg_offsets.data(), arg_offsets.size() * sizeof(uint32_t));
+    write(header.args_offset, args.data(), args.size() * sizeof(int32_t));
+    write(header.bindings_offset, dag_bindings.data(), dag_bindings.size() * sizeof(DagBinding));
+    write(header.binding_nodes_offset, binding_nodes.data(), binding_nodes.size() * sizeof(int32_t));
+    write(header.strings_offset, strings.data(), strings.size());
+    write(header.patterns_offset, patterns.data(), patterns.size() * sizeof(int32_t));
+    if (not ofs) {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
+
+/**
+ * factory rebuilt from a saved graph, without running generate() again.
+ * inputs and outputs are registered as they were in the saved factory.
+ */
+class LoadedFactory : public Factory {
+ public:
+    explicit LoadedFactory(const std::string &path) : LoadedFactory(DagFile(path)) {}
+
+    explicit LoadedFactory(const DagFile &file) {
+        std::vector<Symbol> nodes(file.size());
+        for (size_t i = 0; i < file.size(); i++) {
+            OpCode op = file.opcode(i);
+            ChildTable::Range c = file.children(i);
+            if (not validNumChildren(op, c.size())) {
+                throw std::runtime_error("broken graph file, invalid node " + std::to_string(i));
+            }
+            std::vector<Symbol> args;
+            for (auto &&d : c) {
+                if (d < 0 or static_cast<size_t>(d) >= i) {
+                    throw std::runtime_error("broken graph file, invalid child of node " + std::to_string(i));
+                }
+                args.push_back(nodes[d]);
+            }
+            if (op == OpCode::CONSTANT) {
+                nodes[i] = make_symbol<Constant>(file.constant(i));
+            } else if (op == OpCode::VARIABLE) {
+                nodes[i] = make_symbol<Variable>(file.name(i));
+            } else {
+                nodes[i] = rebuild(op, args);
+            }
+        }
+        for (size_t b = 0; b < file.numBindings(); b++) {
+            const DagBinding &binding = file.binding(b);
+            std::vector<Symbol> symbols;
+            for (size_t k = 0; k < binding.size; k++) {
+                int id = file.bindingNodes(b)[k];
+                if (id >= static_cast<int>(nodes.size())) {
+                    throw std::runtime_error("broken graph file, invalid node of " + std::string(file.bindingName(b)));
+                }
+                symbols.push_back(id >= 0 ? nodes[id] : Symbol());
+            }
+            IOTag tag = binding.tag == static_cast<uint8_t>(IOTag::STATIC) ? IOTag::STATIC : IOTag::DYNAMIC;
+            if (binding.is_input) {
+                addInput(tag, file.bindingName(b), symbols);
+            } else {
+                outputs.push_back(symbols);
+                addOutput(tag, file.bindingName(b), &outputs.back());
+            }
+            if (binding.is_sparse) {
+                const int *p = file.bindingPattern(b);
+                SparsePattern pattern;
+                pattern.rows = binding.rows;
+                pattern.cols = binding.cols;
+                pattern.row_offsets.assign(p, p + binding.rows + 1);
+                p += binding.rows + 1;
+                pattern.col_indices.assign(p, p + binding.nnz);
+                p += binding.nnz;
+                pattern.num_colors = binding.num_colors;
+                if (binding.num_colors) {
+                    pattern.colors.assign(p, p + binding.cols);
+                }
+                patterns.push_back(pattern);
+                addSparsePattern(file.bindingName(b), &patterns.back());
+            }
+        }
+    }
+
+    const std::vector<Symbol> &input(const std::string &name) const {
+        for (auto &&inputs : {&static_inputs, &dynamic_inputs}) {
+            for (auto &&[symbol, vlist] : *inputs) {
+                if (symbol == name) {
+                    return vlist;
+                }
+            }
+        }
+        throw std::runtime_error("no such input : " + name);
+    }
+
+    const std::vector<Symbol> &output(const std::string &name) const {
+        for (auto &&outputs_ : {&static_outputs, &dynamic_outputs}) {
+            for (auto &&[symbol, ptr_vlist] : *outputs_) {
+                if (symbol == name) {
+                    return *ptr_vlist;
+                }
+            }
+        }
+        throw std::runtime_error("no such output : " + name);
+    }
+
+ protected:
+    std::list<std::vector<Symbol>> outputs;
+    std::list<SparsePattern> patterns;
+};
+
+}  // namespace sym
+
+#endif  // DAG_FILE_HPP_
@@ -13,8 +13,13 @@
 namespace sym {
     class Digraph {
      public:
-        Digraph(const std::vector<Repr> &rev_repr_map_, const std::vector<std::unordered_set<int>> &depends_list_,
-                const std::vector<int> &id_mapping_) : rev_repr_map(rev_repr_map_), depends_list(depends_list_), id_mapping(id_mapping_) {
+        // only nodes is printed, children first
+        Digraph(const std::vector<Repr> &rev_repr_map_, const ChildTable &children_,
+                const std::vector<int> &id_mapping_, const std::vector<int> &nodes_)
+            : rev_repr_map(rev_repr_map_), id_mapping(id_mapping_), nodes(nodes_) {
+            for (size_t i = 0; i < rev_repr_map.size(); i++) {
+                children.emplace_back(children_[i].begin(), children_[i].end());
+            }
         }
 
         void setLabel(int key, const std::string &label) {
@@ -25,10 +30,10 @@ namespace sym {
         }
 
         friend std::ostream &operator<<(std::ostream &os, const Digraph &d) {
-            std::vector<Repr> cur_rev_repr_map = d.rev_repr_map;
+            ReprRenderer renderer(d.rev_repr_map);
             os << "digraph graphname {" << std::endl;
-            for (size_t i = 0; i < d.rev_repr_map.size(); i++) {
-                std::string result = cur_rev_repr_map[i](cur_rev_repr_map);
+            for (auto &&i : d.nodes) {
+                std::string result = renderer(i);
                 if (d.labels.find(i) != d.labels.end()) {
                     result = d.labels.find(i)->second;
                 }
@@ -37,11 +42,11 @@ namespace sym {
                     os << " shape=" << d.shapes.find(i)->second;
                 }
                 os << "];" << std::endl;
-                cur_rev_repr_map[i] = _repr(std::to_string(i));
+                renderer.assign(i, std::to_string(i));
             }
-            for (size_t i = 0; i < d.depends_list.size(); i++) {
-                for (auto &&j : d.depends_list[i]) {
-                    os << "    n" << j << " -> n" << i << ";" << std::endl;
+            for (auto &&i : d.nodes) {
+                for (auto &&j : d.children[i]) {
+                    os << "    n" << d.id_mapping[j] << " -> n" << i << ";" << std::endl;
                 }
             }
             return os << "}" << std::endl;
@@ -51,8 +56,9 @@ namespace sym {
         std::unordered_map<int, std::string> labels;
         std::unordered_map<int, std::string> shapes;
         std::vector<Repr> rev_repr_map;
-        std::vector<std::unordered_set<int>> depends_list;
+        std::vector<std::vector<int>> children;
         std::vector<int> id_mapping;
+        std::vector<int> nodes;
     };
 
 } // namespace sym
@@ -0,0 +1,600 @@
+/**
+ * Copyright
+ * @file egraph.hpp
+ * @brief
+ * @author Shogo Sawai
+ * @date 2018-12-20 11:32:08
+ */
+#ifndef EGRAPH_HPP_
+#define EGRAPH_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "factory_base.hpp"
+#include "binary_function.hpp"
+#include "cxx_code_printer.hpp"
+
+namespace sym {
+
+/**
+ * rough latency of an operation as it is printed, in multiplications.
+ * exponent is the chain exponent of a power, 0 if it is printed as pow
+ */
+inline size_t op_cost(OpCode op, size_t num_args, int exponent) {
+    switch (op) {
+        case OpCode::CONSTANT:
+        case OpCode::VARIABLE:
+            return 0;
+        case OpCode::ADD:
+        case OpCode::MUL:
+            return num_args - 1;
+        case OpCode::NEG:
+        case OpCode::SUB:
+            return 1;
+        case OpCode::DIV:
+        case OpCode::SQRT:
+            return 4;
+        case OpCode::POW: {
+            if (exponent == 0) {
+                return 40;
+            }
+            size_t n = std::abs(exponent);
+            size_t cost = n <= 3 ? n - 1 : addition_chain(n).size() - 1;
+            return exponent < 0 ? cost + 4 : cost;
+        }
+        default:
+            return 20;  // transcendental functions
+    }
+}
+
+/**
+ * classes of equivalent expressions for equality saturation. a node is a
+ * NodeKey whose args are class ids. rewrites only add nodes and merge
+ * classes, so every form seen stays available and the cheapest one is
+ * extracted at the end, independent of the order the rules fired in.
+ */
+class EGraph {
+ public:
+    // sums and products with more operands are not rewritten
+    static constexpr size_t max_operands = 8;
+
+    /**
+     * class of n, added if there is none. operands of sums and products are
+     * sorted and their constants folded, a single operand is its own class
+     */
+    int add(NodeKey n) {
+        canonicalize(n);
+        if (n.op == OpCode::ADD or n.op == OpCode::MUL) {
+            bool is_add = n.op == OpCode::ADD;
+            double identity = is_add ? 0 : 1, folded = identity;
+            std::vector<int> args;
+            for (auto &&a : n.args) {
+                if (isConstant(a)) {
+                    folded = is_add ? folded + value(a) : folded * value(a);
+                } else {
+                    args.push_back(a);
+                }
+            }
+            if (not is_add and folded == 0) {
+                return constant(0);
+            }
+            if (folded != identity) {
+                args.push_back(constant(folded));
+            }
+            if (args.empty()) {
+                return constant(identity);
+            }
+            if (args.size() == 1) {
+                return args[0];
+            }
+            std::sort(args.begin(), args.end());
+            n.args = args;
+        } else if (n.op == OpCode::POW and isConstant(n.args[1]) and (value(n.args[1]) == 0 or value(n.args[1]) == 1)) {
+            return value(n.args[1]) == 0 ? constant(1) : n.args[0];
+        } else if (n.op == OpCode::NEG and isConstant(n.args[0])) {
+            return constant(-value(n.args[0]));
+        } else if (n.op == OpCode::SUB and isConstant(n.args[0]) and isConstant(n.args[1])) {
+            return constant(value(n.args[0]) - value(n.args[1]));
+        }
+        auto found = memo.find(n);
+        if (found != memo.end()) {
+            return find(found->second);
+        }
+        int c = classes.size();
+        parents.push_back(c);
+        classes.push_back({{n}, n.op == OpCode::CONSTANT, n.op == OpCode::CONSTANT ? from_bits(n.payload) : 0.0});
+        memo.emplace(n, c);
+        return c;
+    }
+
+    int constant(double v) { return add({OpCode::CONSTANT, {}, to_bits(v == 0 ? 0.0 : v), ""}); }
+
+    int find(int c) {
+        while (parents[c] != c) {
+            parents[c] = parents[parents[c]];
+            c = parents[c];
+        }
+        return c;
+    }
+
+    bool merge(int a, int b) {
+        a = find(a);
+        b = find(b);
+        if (a == b) {
+            return false;
+        }
+        if (classes[a].nodes.size() < classes[b].nodes.size()) {
+            std::swap(a, b);
+        }
+        parents[b] = a;
+        EClass &to = classes[a], &from = classes[b];
+        to.nodes.insert(to.nodes.end(), from.nodes.begin(), from.nodes.end());
+        from.nodes.clear();
+        if (from.is_constant and not to.is_constant) {
+            to.is_constant = true;
+            to.value = from.value;
+        }
+        return true;
+    }
+
+    // restores the invariant that equal nodes are in one class, merging the classes of nodes that became equal
+    void rebuild() {
+        for (bool changed = true; changed;) {
+            changed = false;
+            memo.clear();
+            std::vector<std::tuple<int, int>> merges;
+            for (size_t c = 0; c < classes.size(); c++) {
+                if (find(c) != static_cast<int>(c)) {
+                    continue;
+                }
+                std::vector<NodeKey> unique;
+                for (auto n : classes[c].nodes) {
+                    canonicalize(n);
+                    auto [iter, inserted] = memo.emplace(n, c);
+                    if (inserted) {
+                        unique.push_back(n);
+                    } else if (iter->second != static_cast<int>(c)) {
+                        merges.emplace_back(iter->second, c);
+                    }
+                }
+                classes[c].nodes = unique;
+            }
+            for (auto &&[a, b] : merges) {
+                changed = merge(a, b) or changed;
+            }
+        }
+    }
+
+    size_t numNodes() const { return memo.size(); }
+
+    /**
+     * applies every rule to every node until nothing changes, the number of
+     * nodes exceeds max_nodes, max_iterations passes were made or
+     * max_seconds passed. returns whether it saturated. a finite
+     * max_seconds makes the result depend on the speed of the machine
+     */
+    bool saturate(size_t max_nodes, int max_iterations, double max_seconds) {
+        auto start = std::chrono::steady_clock::now();
+        auto out_of_budget = [&]() {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return numNodes() > max_nodes or elapsed.count() > max_seconds;
+        };
+        for (iteration = 0; iteration < max_iterations; iteration++) {
+            size_t nodes_before = numNodes();
+            for (auto &&rs : schedule) {
+                rs.applied = 0;
+            }
+            class_info.clear();
+            bool stopped = false;
+            size_t num_classes = classes.size();
+            for (size_t c = 0; c < num_classes and not stopped; c++) {
+                if (find(c) != static_cast<int>(c)) {
+                    continue;
+                }
+                std::vector<NodeKey> nodes = classes[c].nodes;  // rules add classes
+                for (auto &&n : nodes) {
+                    applyRules(c, n);
+                }
+                stopped = out_of_budget();
+            }
+            bool merged = false;
+            for (auto &&[a, b] : pending) {
+                merged = merge(a, b) or merged;
+            }
+            pending.clear();
+            rebuild();
+            if (stopped) {
+                return false;
+            }
+            bool banned = std::any_of(std::begin(schedule), std::end(schedule),
+                                      [this](const RuleSchedule &rs) { return rs.banned_until > iteration + 1; });
+            if (not merged and numNodes() == nodes_before and not banned) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * cheapest node of every class, indexed by class, by the op_cost of the
+     * whole expression tree. a node reached through a cycle is never the
+     * cheapest, so the chosen nodes form a dag
+     */
+    std::vector<NodeKey> extract() {
+        rebuild();
+        std::vector<double> cost(classes.size(), std::numeric_limits<double>::infinity());
+        std::vector<NodeKey> best(classes.size());
+        std::vector<std::vector<size_t>> node_costs(classes.size());
+        for (size_t c = 0; c < classes.size(); c++) {
+            for (auto &&n : classes[c].nodes) {
+                node_costs[c].push_back(op_cost(n.op, n.args.size(), n.op == OpCode::POW ? chainExponent(n) : 0));
+            }
+        }
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t c = 0; c < classes.size(); c++) {
+                for (size_t k = 0; k < classes[c].nodes.size(); k++) {
+                    const NodeKey &n = classes[c].nodes[k];
+                    double s = node_costs[c][k];
+                    for (auto &&a : n.args) {
+                        s += cost[find(a)];
+                    }
+                    if (s < cost[c]) {
+                        cost[c] = s;
+                        best[c] = n;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        return best;
+    }
+
+ protected:
+    struct EClass {
+        std::vector<NodeKey> nodes;
+        bool is_constant;
+        double value;
+    };
+
+    void canonicalize(NodeKey &n) {
+        for (auto &&a : n.args) {
+            a = find(a);
+        }
+        if (n.op == OpCode::ADD or n.op == OpCode::MUL) {
+            std::sort(n.args.begin(), n.args.end());
+        }
+    }
+
+    bool isConstant(int c) { return classes[find(c)].is_constant; }
+    double value(int c) { return classes[find(c)].value; }
+
+    int chainExponent(const NodeKey &n) {
+        if (not isConstant(n.args[1])) {
+            return 0;
+        }
+        double e = value(n.args[1]);
+        if (e != std::floor(e) or std::abs(e) > max_chain_exponent) {
+            return 0;
+        }
+        return static_cast<int>(e);
+    }
+
+    std::vector<NodeKey> nodes(int c, OpCode op) {
+        std::vector<NodeKey> result;
+        for (auto &&n : classes[find(c)].nodes) {
+            if (n.op == op) {
+                result.push_back(n);
+            }
+        }
+        return result;
+    }
+
+    // b if c is -1 * b
+    int negated(int c) {
+        for (auto &&n : classes[find(c)].nodes) {
+            if (n.op == OpCode::NEG) {
+                return find(n.args[0]);
+            }
+            if (n.op == OpCode::MUL and n.args.size() == 2) {
+                for (size_t k = 0; k < 2; k++) {
+                    if (isConstant(n.args[k]) and value(n.args[k]) == -1) {
+                        return find(n.args[1 - k]);
+                    }
+                }
+            }
+        }
+        return -1;
+    }
+
+    // ways to write c as a product, at most max_operands of them: c itself, the operands of its products and b, b^(n-1) of b^n
+    std::vector<std::vector<int>> factorings(int c) {
+        std::vector<std::vector<int>> result{{find(c)}};
+        std::vector<NodeKey> nodes = classes[find(c)].nodes;  // add may move them
+        for (auto &&n : nodes) {
+            if (result.size() >= max_operands) {
+                break;
+            }
+            if (n.op == OpCode::MUL and n.args.size() <= max_operands) {
+                result.push_back(n.args);
+            } else if (n.op == OpCode::POW) {
+                int e = chainExponent(n);
+                if (e >= 2) {
+                    result.push_back({find(n.args[0]), add({OpCode::POW, {n.args[0], constant(e - 1)}, 0, ""})});
+                }
+            }
+        }
+        return result;
+    }
+
+    int product(const std::vector<int> &args) { return add({OpCode::MUL, args, 0, ""}); }
+    int sum(const std::vector<int> &args) { return add({OpCode::ADD, args, 0, ""}); }
+
+    static std::vector<int> without(std::vector<int> args, size_t i) {
+        args.erase(args.begin() + i);
+        return args;
+    }
+
+    static std::vector<int> without(std::vector<int> args, size_t i, size_t j) {
+        args.erase(args.begin() + std::max(i, j));
+        args.erase(args.begin() + std::min(i, j));
+        return args;
+    }
+
+    enum Rule {
+        SUB_TO_SUM, NEG_TO_PRODUCT, PARITY, PRODUCT_ASSOCIATIVITY, DISTRIBUTE,
+        SUM_TO_SUB, SUM_ASSOCIATIVITY, LIKE_TERMS, COMMON_FACTOR, PYTHAGOREAN, num_rules
+    };
+
+    /**
+     * a rule that fires more than match_limit << times_banned times in a
+     * pass is skipped for the rest of it and the next 1 << times_banned
+     * passes, so associativity and distributivity can not fill the budget
+     * before the other rules had their turn
+     */
+    struct RuleSchedule {
+        size_t applied{0};
+        int banned_until{0};
+        int times_banned{0};
+    };
+    static constexpr size_t match_limit = 256;
+
+    bool active(Rule r) const { return schedule[r].banned_until <= iteration; }
+
+    void equal(Rule r, int id) {
+        RuleSchedule &rs = schedule[r];
+        pending.emplace_back(current, id);
+        if (++rs.applied > (match_limit << rs.times_banned)) {
+            rs.banned_until = iteration + 1 + (1 << rs.times_banned);
+            rs.times_banned++;
+        }
+    }
+
+    void applyRules(int c, const NodeKey &n) {
+        current = c;
+        switch (n.op) {
+            case OpCode::SUB:
+                // a - b = a + -1 * b, so the rules of sums apply through subtractions
+                if (active(SUB_TO_SUM)) {
+                    equal(SUB_TO_SUM, sum({n.args[0], product({n.args[1], constant(-1)})}));
+                }
+                break;
+            case OpCode::NEG:
+                if (active(NEG_TO_PRODUCT)) {
+                    equal(NEG_TO_PRODUCT, product({n.args[0], constant(-1)}));
+                }
+                break;
+            case OpCode::SIN:
+            case OpCode::COS: {
+                // sin(-x) = -sin(x), cos(-x) = cos(x)
+                int x = active(PARITY) ? negated(n.args[0]) : -1;
+                if (x >= 0) {
+                    int f = add({n.op, {x}, 0, ""});
+                    equal(PARITY, n.op == OpCode::SIN ? product({f, constant(-1)}) : f);
+                }
+                break;
+            }
+            case OpCode::ADD:
+                if (n.args.size() <= max_operands) {
+                    sumRules(n.args);
+                }
+                break;
+            case OpCode::MUL:
+                if (n.args.size() <= max_operands) {
+                    productRules(n.args);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void productRules(const std::vector<int> &args) {
+        for (size_t i = 0; i < args.size(); i++) {
+            for (auto &&m : active(PRODUCT_ASSOCIATIVITY) ? nodes(args[i], OpCode::MUL) : std::vector<NodeKey>()) {
+                std::vector<int> flat = without(args, i);
+                flat.insert(flat.end(), m.args.begin(), m.args.end());
+                if (flat.size() <= max_operands) {
+                    equal(PRODUCT_ASSOCIATIVITY, product(flat));
+                    break;
+                }
+            }
+            // a * (b + c) = a * b + a * c
+            for (auto &&s : active(DISTRIBUTE) ? nodes(args[i], OpCode::ADD) : std::vector<NodeKey>()) {
+                if (s.args.size() > max_operands) {
+                    continue;
+                }
+                std::vector<int> terms;
+                for (auto &&t : s.args) {
+                    std::vector<int> factors = without(args, i);
+                    factors.push_back(t);
+                    terms.push_back(product(factors));
+                }
+                equal(DISTRIBUTE, sum(terms));
+                return;
+            }
+        }
+    }
+
+    void sumRules(const std::vector<int> &args) {
+        for (size_t i = 0; i < args.size(); i++) {
+            // a + -1 * b = a - b
+            int b = active(SUM_TO_SUB) ? negated(args[i]) : -1;
+            if (b >= 0) {
+                equal(SUM_TO_SUB, add({OpCode::SUB, {sum(without(args, i)), b}, 0, ""}));
+            }
+            for (auto &&s : active(SUM_ASSOCIATIVITY) ? nodes(args[i], OpCode::ADD) : std::vector<NodeKey>()) {
+                std::vector<int> flat = without(args, i);
+                flat.insert(flat.end(), s.args.begin(), s.args.end());
+                if (flat.size() <= max_operands) {
+                    equal(SUM_ASSOCIATIVITY, sum(flat));
+                    break;
+                }
+            }
+        }
+        // operand pairs are found through maps from what they share, at most one rewrite per pair and rule
+        std::vector<const ClassInfo*> info;
+        for (auto &&a : args) {
+            info.push_back(&classInfo(a));
+        }
+        std::set<std::tuple<Rule, size_t, size_t>> done;
+        auto first = [&](Rule r, size_t i, size_t j) { return i != j and done.emplace(r, i, j).second; };
+
+        // k * a + l * a = (k + l) * a
+        std::map<std::vector<int>, std::tuple<size_t, double>> like;
+        for (size_t j = 0; j < args.size() and active(LIKE_TERMS); j++) {
+            for (auto &&t : info[j]->terms) {
+                auto [iter, inserted] = like.emplace(t.factors, std::make_tuple(j, t.k));
+                auto [i, k] = iter->second;
+                if (not inserted and first(LIKE_TERMS, i, j)) {
+                    std::vector<int> factors = t.factors;
+                    factors.push_back(constant(k + t.k));
+                    std::vector<int> others = without(args, i, j);
+                    others.push_back(product(factors));
+                    equal(LIKE_TERMS, sum(others));
+                }
+            }
+        }
+
+        // f * a + f * b = f * (a + b)
+        std::map<int, std::tuple<size_t, const std::vector<int>*, size_t>> common;
+        for (size_t j = 0; j < args.size() and active(COMMON_FACTOR); j++) {
+            for (auto &&factors : info[j]->factorings) {
+                for (size_t q = 0; q < factors.size(); q++) {
+                    if (isConstant(factors[q])) {
+                        continue;
+                    }
+                    auto [iter, inserted] = common.emplace(find(factors[q]), std::make_tuple(j, &factors, q));
+                    auto [i, other, p] = iter->second;
+                    if (not inserted and first(COMMON_FACTOR, i, j)) {
+                        int inner = sum({product(without(*other, p)), product(without(factors, q))});
+                        std::vector<int> others = without(args, i, j);
+                        others.push_back(product({factors[q], inner}));
+                        equal(COMMON_FACTOR, sum(others));
+                    }
+                }
+            }
+        }
+
+        // k * sin(x)^2 + k * cos(x)^2 = k
+        std::map<std::tuple<int, double, std::vector<int>>, size_t> sines;
+        for (size_t i = 0; i < args.size() and active(PYTHAGOREAN); i++) {
+            for (auto &&t : info[i]->sin_squares) {
+                sines.emplace(std::make_tuple(t.x, t.k, t.factors), i);
+            }
+        }
+        for (size_t j = 0; j < args.size() and active(PYTHAGOREAN) and sines.size(); j++) {
+            for (auto &&t : info[j]->cos_squares) {
+                auto found = sines.find(std::make_tuple(t.x, t.k, t.factors));
+                if (found != sines.end() and first(PYTHAGOREAN, found->second, j)) {
+                    std::vector<int> factors = t.factors;
+                    factors.push_back(constant(t.k));
+                    std::vector<int> others = without(args, found->second, j);
+                    others.push_back(product(factors));
+                    equal(PYTHAGOREAN, sum(others));
+                }
+            }
+        }
+    }
+
+    // k * prod factors with the factors sorted, x is the argument of the square a term of squares was divided by
+    struct Term {
+        double k;
+        std::vector<int> factors;
+        int x;
+    };
+
+    // what the rules of sums look at in an operand, it does not change within a pass as merges are deferred
+    struct ClassInfo {
+        std::vector<std::vector<int>> factorings;
+        std::vector<Term> terms, sin_squares, cos_squares;
+    };
+
+    const ClassInfo &classInfo(int c) {
+        c = find(c);
+        auto found = class_info.find(c);
+        if (found != class_info.end()) {
+            return found->second;
+        }
+        ClassInfo info;
+        info.factorings = factorings(c);
+        for (auto &&factors : info.factorings) {
+            info.terms.push_back(term(factors));
+            squares(factors, info.sin_squares, info.cos_squares);
+        }
+        return class_info.emplace(c, info).first->second;
+    }
+
+    Term term(const std::vector<int> &factors) {
+        Term t{1, {}, -1};
+        for (auto &&a : factors) {
+            if (isConstant(a)) {
+                t.k *= value(a);
+            } else {
+                t.factors.push_back(find(a));
+            }
+        }
+        std::sort(t.factors.begin(), t.factors.end());
+        return t;
+    }
+
+    // the ways to write factors as a term times sin(x)^2 or cos(x)^2
+    void squares(const std::vector<int> &factors, std::vector<Term> &sin_squares, std::vector<Term> &cos_squares) {
+        for (size_t p = 0; p < factors.size(); p++) {
+            for (auto &&s : classes[find(factors[p])].nodes) {
+                if (s.op != OpCode::POW or chainExponent(s) != 2) {
+                    continue;
+                }
+                for (auto &&t : classes[find(s.args[0])].nodes) {
+                    if (t.op == OpCode::SIN or t.op == OpCode::COS) {
+                        Term r = term(without(factors, p));
+                        r.x = find(t.args[0]);
+                        (t.op == OpCode::SIN ? sin_squares : cos_squares).push_back(r);
+                    }
+                }
+            }
+        }
+    }
+
+ protected:
+    std::vector<int> parents;
+    std::vector<EClass> classes;
+    std::unordered_map<NodeKey, int, NodeKeyHash> memo;
+    RuleSchedule schedule[num_rules];
+    int iteration{0};
+    int current{0};  // class of the node the rules are applied to
+    std::vector<std::tuple<int, int>> pending;  // classes found equal in this pass
+    std::unordered_map<int, ClassInfo> class_info;  // of this pass
+};
+
+}  // namespace sym
+
+#endif  // EGRAPH_HPP_
@@ -8,13 +8,27 @@
 #ifndef FACTORY_HPP_
 #define FACTORY_HPP_
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <numeric>
+#include <queue>
+#include <unordered_map>
+#include <thread>
 #include <ostream>
+#include <sstream>
+#include <exception>
+#include <limits>
+#include <map>
 
 #include "factory_base.hpp"
 #include "function.hpp"
+#include "unary_function.hpp"
+#include "binary_function.hpp"
 #include "calculation_graph.hpp"
 #include "cxx_code_printer.hpp"
 #include "digraph.hpp"
+#include "egraph.hpp"
 
 namespace sym {
 
@@ -23,6 +37,61 @@ enum class IOTag {
     DYNAMIC,
 };
 
+/**
+ * structurally nonzero entries of a rows x cols matrix output, in CSR form.
+ * the output holds the values of these entries packed in row major order,
+ * or if colors is set, the rows x num_colors compressed matrix whose entry
+ * (r, colors[c]) is the value of (r, c).
+ */
+struct SparsePattern {
+    int rows{0}, cols{0};
+    std::vector<int> row_offsets{0}, col_indices;
+    int num_colors{0};
+    std::vector<int> colors;  // color of each column, empty unless compressed
+
+    size_t nnz() const { return col_indices.size(); }
+    bool operator==(const SparsePattern &rhs) const {
+        return rows == rhs.rows and cols == rhs.cols and row_offsets == rhs.row_offsets and
+            col_indices == rhs.col_indices and num_colors == rhs.num_colors and colors == rhs.colors;
+    }
+};
+
+/**
+ * greedy coloring of the columns of pattern, largest column first. columns
+ * sharing a row get different colors, so the columns of one color are
+ * structurally orthogonal and can be computed as their sum.
+ */
+inline std::vector<int> colorColumns(const SparsePattern &pattern) {
+    std::vector<std::vector<int>> column_rows(pattern.cols);
+    for (int r = 0; r < pattern.rows; r++) {
+        for (int k = pattern.row_offsets[r]; k < pattern.row_offsets[r + 1]; k++) {
+            column_rows[pattern.col_indices[k]].push_back(r);
+        }
+    }
+    std::vector<int> order(pattern.cols);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int lhs, int rhs) {
+            return column_rows[lhs].size() > column_rows[rhs].size();
+        });
+    std::vector<int> colors(pattern.cols, -1), forbidden(pattern.cols + 1, -1);
+    for (auto &&c : order) {
+        for (auto &&r : column_rows[c]) {
+            for (int k = pattern.row_offsets[r]; k < pattern.row_offsets[r + 1]; k++) {
+                int color = colors[pattern.col_indices[k]];
+                if (color >= 0) {
+                    forbidden[color] = c;
+                }
+            }
+        }
+        int color = 0;
+        while (forbidden[color] == c) {
+            color++;
+        }
+        colors[c] = color;
+    }
+    return colors;
+}
+
 class Factory : public FactoryBase {
  public:
     static void addInput(IOTag tag, const std::string &symbol, const std::vector<Symbol> &inputs_) {
@@ -51,6 +120,11 @@ class Factory : public FactoryBase {
         }
     }
 
+    // marks the output symbol as the packed values of a sparse matrix
+    static void addSparsePattern(const std::string &symbol, const SparsePattern *pattern) {
+        get()->sparse_patterns.emplace_back(symbol, pattern);
+    }
+
  protected:
     static Factory *get() {
         return dynamic_cast<Factory*>(FactoryBase::get());
@@ -58,29 +132,649 @@ class Factory : public FactoryBase {
 
  public:
     virtual ~Factory() {}
-    Symbol diff(const Symbol &func, const Symbol &var) { return func->diff(var); }
+    Symbol diff(const Symbol &func, const Symbol &var) {
+        Scope scope(*this);
+        Symbol result = budgetedDiff(func, var);
+        collectIfNeeded();
+        return result;
+    }
+
+    // a derivative that exceeded the budget of setDiffNodeBudget and was built again through the local partials
+    struct SwellReport {
+        std::string function, variable;
+        size_t num_nodes;  // added before it was stopped
+    };
+
+    /**
+     * a single derivative of diff, jacobian or hessian that adds more than
+     * num_nodes nodes is stopped while it is built, reported in
+     * swellReports and built again by the chain rule through the local
+     * partials of every node (see setDiffThroughPartials). the derivatives
+     * of subexpressions finished before stay memoized. nodes are counted
+     * per thread, so the budget holds inside parallelFor as well. 0 disables
+     */
+    void setDiffNodeBudget(size_t num_nodes) {
+        diff_node_budget = num_nodes;
+    }
+
+    const std::vector<SwellReport> &swellReports() const { return swell_reports; }
+
+    // chain rule on the graph, d f / d v = sum_k d f / d child_k * d child_k / d v with the first factor built once per node.
+    // the rules of each function are used otherwise, except after the node budget is exceeded
+    void setDiffThroughPartials(bool enable) {
+        Scope scope(*this);
+        FactoryBase::setDiffThroughPartials(enable);
+    }
+
+    // gradient of f with respect to the variables in inputs, see vjp
+    template<class Inputs>
+    std::vector<Symbol> gradient(const Symbol &f, const Inputs &inputs) {
+        Scope scope(*this);
+        return vjp(std::vector<Symbol>{f}, inputs, std::vector<Symbol>{one()});
+    }
+
+    /**
+     * sum_k cotangents[k] * d outputs[k] / d inputs[i], built in a single
+     * reverse sweep. the adjoint of every node is the sum over its parents of
+     * the parent adjoint times the local partial, so primal subexpressions
+     * are shared and the cost is a small multiple of the outputs themselves.
+     */
+    template<class Outputs, class Inputs, class Cotangents>
+    std::vector<Symbol> vjp(const Outputs &outputs, const Inputs &inputs, const Cotangents &cotangents) {
+        Scope scope(*this);
+        VariableSet wrt;
+        for (size_t i = 0; i < inputs.size(); i++) {
+            int index = variableIndex(inputs[i]->id());
+            if (index < 0) {
+                throw std::runtime_error("derivative is only defined with respect to variables");
+            }
+            wrt.insert(index);
+        }
+        std::vector<int> roots;
+        // the terms of every adjoint are summed by one node when it is final
+        std::vector<std::vector<Symbol>> adjoint_terms(size());
+        for (size_t k = 0; k < outputs.size(); k++) {
+            if (is_zero(cotangents[k])) {
+                continue;
+            }
+            int id = alias(outputs[k]->id());
+            roots.push_back(id);
+            adjoint_terms[id].push_back(cotangents[k]);
+        }
+        std::vector<int> order = topologicalOrder(roots, &wrt);
+        for (auto iter = order.rbegin(); iter != order.rend(); ++iter) {
+            if (adjoint_terms[*iter].empty()) {
+                continue;
+            }
+            Symbol adjoint = sum(adjoint_terms[*iter]);
+            if (is_zero(adjoint)) {
+                continue;
+            }
+            const Function *node = function(*iter);
+            ChildTable::Range c = children(*iter);
+            for (size_t k = 0; k < c.size(); k++) {
+                int child = alias(c[k]);
+                if (not variableDepends(child).intersects(wrt)) {
+                    continue;
+                }
+                adjoint_terms[child].push_back(make_symbol<MulFunction>(adjoint, node->localPartial(k)));
+            }
+        }
+        std::vector<Symbol> result;
+        for (size_t i = 0; i < inputs.size(); i++) {
+            result.push_back(sum(adjoint_terms[inputs[i]->id()]));
+        }
+        collectIfNeeded();
+        return result;
+    }
+
+    /**
+     * jacobian[k][i] = d outputs[k] / d inputs[i]. derivatives are memoized
+     * per (node, variable), so subtrees shared by several outputs are
+     * differentiated once, and blocks that cannot depend on an input are
+     * zero without differentiating.
+     */
+    template<class Outputs, class Inputs>
+    std::vector<std::vector<Symbol>> jacobian(const Outputs &outputs, const Inputs &inputs) {
+        Scope scope(*this);
+        std::vector<std::vector<Symbol>> result(outputs.size(), std::vector<Symbol>(inputs.size()));
+        for (size_t k = 0; k < outputs.size(); k++) {
+            for (size_t i = 0; i < inputs.size(); i++) {
+                if (checkDepends(outputs[k]->id(), inputs[i]->id())) {
+                    result[k][i] = budgetedDiff(outputs[k], inputs[i]);
+                } else {
+                    result[k][i] = zero();
+                }
+            }
+        }
+        collectIfNeeded();
+        return result;
+    }
+
+    /**
+     * hessian[i][j] = d^2 f / d inputs[i] d inputs[j]. the gradient is built
+     * in reverse mode and differentiated once more with memoization, only the
+     * upper triangle is computed and mirrored.
+     */
+    template<class Inputs>
+    std::vector<std::vector<Symbol>> hessian(const Symbol &f, const Inputs &inputs) {
+        Scope scope(*this);
+        std::vector<Symbol> g = gradient(f, inputs);
+        std::vector<std::vector<Symbol>> result(inputs.size(), std::vector<Symbol>(inputs.size()));
+        for (size_t i = 0; i < inputs.size(); i++) {
+            for (size_t j = i; j < inputs.size(); j++) {
+                if (checkDepends(g[i]->id(), inputs[j]->id())) {
+                    result[i][j] = budgetedDiff(g[i], inputs[j]);
+                } else {
+                    result[i][j] = zero();
+                }
+                result[j][i] = result[i][j];
+            }
+        }
+        collectIfNeeded();
+        return result;
+    }
+
+    /**
+     * sum_i d outputs[k] / d inputs[i] * tangents[i] in a single forward
+     * sweep. the tangent of every node is the sum over its children of the
+     * local partial times the child tangent, nodes that do not depend on an
+     * input with a nonzero tangent are skipped.
+     */
+    template<class Outputs, class Inputs, class Tangents>
+    std::vector<Symbol> jvp(const Outputs &outputs, const Inputs &inputs, const Tangents &tangents) {
+        Scope scope(*this);
+        VariableSet wrt;
+        std::vector<Symbol> node_tangents(size());
+        for (size_t i = 0; i < inputs.size(); i++) {
+            int index = variableIndex(inputs[i]->id());
+            if (index < 0) {
+                throw std::runtime_error("derivative is only defined with respect to variables");
+            }
+            if (is_zero(tangents[i])) {
+                continue;
+            }
+            wrt.insert(index);
+            Symbol &t = node_tangents[inputs[i]->id()];
+            t = t ? make_symbol<AddFunction>(t, tangents[i]) : tangents[i];
+        }
+        std::vector<int> roots;
+        for (size_t k = 0; k < outputs.size(); k++) {
+            roots.push_back(outputs[k]->id());
+        }
+        for (auto &&id : topologicalOrder(roots, &wrt)) {
+            if (node_tangents[id]) {
+                continue;  // an input
+            }
+            const Function *node = function(id);
+            ChildTable::Range c = children(id);
+            std::vector<Symbol> terms;
+            for (size_t k = 0; k < c.size(); k++) {
+                Symbol child_tangent = node_tangents[alias(c[k])];
+                if (child_tangent) {
+                    terms.push_back(make_symbol<MulFunction>(node->localPartial(k), child_tangent));
+                }
+            }
+            node_tangents[id] = sum(terms);
+        }
+        std::vector<Symbol> result;
+        for (size_t k = 0; k < outputs.size(); k++) {
+            Symbol t = node_tangents[alias(outputs[k]->id())];
+            result.push_back(t ? t : zero());
+        }
+        collectIfNeeded();
+        return result;
+    }
+
+    /**
+     * hessian of f times tangents, forward over reverse: jvp of the reverse
+     * mode gradient. the hessian is never formed, the result costs a small
+     * multiple of f.
+     */
+    template<class Inputs, class Tangents>
+    std::vector<Symbol> hvp(const Symbol &f, const Inputs &inputs, const Tangents &tangents) {
+        Scope scope(*this);
+        return jvp(gradient(f, inputs), inputs, tangents);
+    }
+
+    // structural nonzeros of jacobian(outputs, inputs), from the variable dependencies without differentiating
+    template<class Outputs, class Inputs>
+    SparsePattern jacobianPattern(const Outputs &outputs, const Inputs &inputs) const {
+        Scope scope(*this);
+        SparsePattern pattern;
+        pattern.rows = outputs.size();
+        pattern.cols = inputs.size();
+        for (size_t k = 0; k < outputs.size(); k++) {
+            for (size_t i = 0; i < inputs.size(); i++) {
+                if (checkDepends(outputs[k]->id(), inputs[i]->id())) {
+                    pattern.col_indices.push_back(i);
+                }
+            }
+            pattern.row_offsets.push_back(pattern.col_indices.size());
+        }
+        return pattern;
+    }
+
+    // structural nonzeros of hessian(f, inputs), the gradient is built to find them
+    template<class Inputs>
+    SparsePattern hessianPattern(const Symbol &f, const Inputs &inputs) {
+        return jacobianPattern(gradient(f, inputs), inputs);
+    }
+
+    /**
+     * jacobian times the seed matrix of a column coloring, compressed[k][c]
+     * is the sum of d outputs[k] / d inputs[i] over the inputs of color c.
+     * one forward sweep per color instead of one per input, structurally
+     * orthogonal columns are recovered with SparseOutput::compress.
+     */
+    template<class Outputs, class Inputs>
+    std::vector<std::vector<Symbol>> compressedJacobian(const Outputs &outputs, const Inputs &inputs, const std::vector<int> &colors) {
+        Scope scope(*this);
+        int num_colors = colors.size() ? *std::max_element(colors.begin(), colors.end()) + 1 : 0;
+        std::vector<std::vector<Symbol>> result(outputs.size(), std::vector<Symbol>(num_colors));
+        for (int color = 0; color < num_colors; color++) {
+            std::vector<Symbol> seed;
+            for (size_t i = 0; i < inputs.size(); i++) {
+                seed.push_back(colors.at(i) == color ? one() : zero());
+            }
+            std::vector<Symbol> column = jvp(outputs, inputs, seed);
+            for (size_t k = 0; k < outputs.size(); k++) {
+                result[k][color] = column[k];
+            }
+        }
+        return result;
+    }
+
+    // compressed hessian, forward sweeps over the reverse mode gradient
+    template<class Inputs>
+    std::vector<std::vector<Symbol>> compressedHessian(const Symbol &f, const Inputs &inputs, const std::vector<int> &colors) {
+        return compressedJacobian(gradient(f, inputs), inputs, colors);
+    }
+
+    /**
+     * gauss-newton normal equations of residuals, returns the upper triangle
+     * of J^T W J packed row by row ((0, 0), (0, 1), .., (1, 1), ..) and
+     * J^T W r, where W is diagonal with weights (identity if empty). the
+     * jacobian is only an intermediate, printing both results as outputs
+     * gives one kernel that shares the residual and jacobian subexpressions
+     * and never stores J.
+     */
+    template<class Residuals, class Inputs>
+    std::tuple<std::vector<Symbol>, std::vector<Symbol>> normalEquations(const Residuals &residuals, const Inputs &inputs,
+                                                                         const std::vector<Symbol> &weights = {}) {
+        Scope scope(*this);
+        if (weights.size() and weights.size() != residuals.size()) {
+            throw std::runtime_error("number of weights and residuals mismatch");
+        }
+        std::vector<std::vector<Symbol>> j = jacobian(residuals, inputs), wj = j;
+        if (weights.size()) {
+            for (size_t k = 0; k < residuals.size(); k++) {
+                for (auto &&e : wj[k]) {
+                    e = is_zero(e) ? e : make_symbol<MulFunction>(weights[k], e);
+                }
+            }
+        }
+        size_t n = inputs.size();
+        std::vector<Symbol> jtj, jtr;
+        for (size_t i = 0; i < n; i++) {
+            for (size_t l = i; l < n; l++) {
+                std::vector<Symbol> terms;
+                for (size_t k = 0; k < residuals.size(); k++) {
+                    if (not is_zero(wj[k][i]) and not is_zero(j[k][l])) {
+                        terms.push_back(make_symbol<MulFunction>(wj[k][i], j[k][l]));
+                    }
+                }
+                jtj.push_back(sum(terms));
+            }
+            std::vector<Symbol> terms;
+            for (size_t k = 0; k < residuals.size(); k++) {
+                if (not is_zero(wj[k][i])) {
+                    terms.push_back(make_symbol<MulFunction>(wj[k][i], residuals[k]));
+                }
+            }
+            jtr.push_back(sum(terms));
+        }
+        collectIfNeeded();
+        return {jtj, jtr};
+    }
+
+    /**
+     * gradient of loss(x_T) with respect to the variables in wrt, where
+     * x_0 = initial and x_{t+1} = step(x_t) for num_steps steps. it is
+     * printed as the member function
+     * name(dynamic inputs.., name_value, name_gradient) of the generated
+     * class, in which one step and its adjoint are printed once and run in
+     * loops. the reverse sweep stores at most num_checkpoints + 1 states and
+     * recomputes the others from them with a binomial (revolve) schedule,
+     * fewer checkpoints trade memory for recomputed steps (0 recomputes
+     * every state from x_0).
+     */
+    template<class Initial, class Wrt, class Step, class Loss>
+    void addCheckpointedGradient(const std::string &name, const Initial &initial, const Wrt &wrt,
+                                 int num_steps, int num_checkpoints, Step step, Loss loss) {
+        Scope scope(*this);
+        if (initial.size() == 0 or num_steps < 0 or num_checkpoints < 0) {
+            throw std::runtime_error("invalid checkpointed gradient " + name);
+        }
+        CheckpointedGradient g;
+        g.name = name;
+        g.num_steps = num_steps;
+        g.num_checkpoints = num_checkpoints;
+        std::vector<Symbol> x, a, inputs, accumulated;
+        for (size_t i = 0; i < initial.size(); i++) {
+            g.initial.push_back(initial[i]);
+            x.push_back(make_symbol<Variable>("_x[" + std::to_string(i) + "]"));
+            a.push_back(make_symbol<Variable>("_a[" + std::to_string(i) + "]"));
+        }
+        inputs = x;
+        for (size_t j = 0; j < wrt.size(); j++) {
+            g.wrt.push_back(wrt[j]);
+            inputs.push_back(wrt[j]);
+            accumulated.push_back(make_symbol<Variable>(name + "_gradient[" + std::to_string(j) + "]"));
+        }
+        size_t n = x.size();
+        auto add = [](const Symbol &lhs, const Symbol &rhs) { return make_symbol<AddFunction>(lhs, rhs); };
+
+        g.step = step(x);
+        if (g.step.size() != n) {
+            throw std::runtime_error("step of " + name + " changes the state size");
+        }
+        std::vector<Symbol> d = vjp(g.step, inputs, a);
+        g.step_adjoint.assign(d.begin(), d.begin() + n);
+        for (size_t j = 0; j < g.wrt.size(); j++) {
+            g.step_gradient.push_back(add(accumulated[j], d[n + j]));
+        }
+
+        g.loss.push_back(loss(x));
+        d = gradient(g.loss[0], inputs);
+        g.loss_adjoint.assign(d.begin(), d.begin() + n);
+        g.loss_gradient.assign(d.begin() + n, d.end());
+
+        d = vjp(g.initial, g.wrt, a);
+        for (size_t j = 0; j < g.wrt.size(); j++) {
+            g.initial_gradient.push_back(add(accumulated[j], d[j]));
+        }
+        checkpointed_gradients.push_back(g);
+    }
+
+    /**
+     * removes the nodes that are neither reachable from an input or output
+     * nor from a live Symbol, and renumbers the rest. Function pointers taken
+     * before are invalidated. returns the number of removed nodes
+     */
+    size_t collect() {
+        Scope scope(*this);
+        std::vector<int> roots;
+        for (auto &&inputs : {&static_inputs, &dynamic_inputs}) {
+            for (auto &&[symbol, vlist] : *inputs) {
+                for (auto &&v : vlist) {
+                    roots.push_back(v->id());
+                }
+            }
+        }
+        for (auto &&outputs : {&static_outputs, &dynamic_outputs}) {
+            for (auto &&[symbol, ptr_vlist] : *outputs) {
+                for (auto &&v : *ptr_vlist) {
+                    if (v) {
+                        roots.push_back(v->id());
+                    }
+                }
+            }
+        }
+        size_t removed = _collect(roots);
+        size_after_collection = size();
+        return removed;
+    }
+
+    // writes the nodes reachable from the inputs and outputs in binary form, see dag_file.hpp
+    void save(const std::string &path) const;
+
+    // collect automatically in diff once more than num_nodes nodes were added since the last collection, 0 disables
+    void setCollectionThreshold(size_t num_nodes) {
+        collection_threshold = num_nodes;
+    }
+
+    /**
+     * calls f(i) for i in [0, n) on num_threads threads (hardware_concurrency
+     * if 0), with this factory current on each of them. nodes may be created
+     * concurrently, the first exception thrown by f is rethrown here.
+     */
+    template<class F>
+    void parallelFor(int n, F f, int num_threads = 0) {
+        if (num_threads <= 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        num_threads = std::min(num_threads, n);
+        std::atomic<int> next(0);
+        std::exception_ptr error;
+        parallel_depth++;
+        std::mutex error_mutex;
+        auto worker = [&]() {
+            Scope scope(*this);
+            for (int i; (i = next++) < n;) {
+                try {
+                    f(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (not error) {
+                        error = std::current_exception();
+                    }
+                    next = n;
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int i = 1; i < num_threads; i++) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto &&t : threads) {
+            t.join();
+        }
+        parallel_depth--;
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    /**
+     * distributes products over sums, bottom up over every node reachable
+     * from s. like terms are merged as the sums are built, a product that
+     * would expand into more than max_expanded_terms terms is kept.
+     */
     Symbol expand(const Symbol &s) {
-        // TODO: implement
-        return s;
+        Scope scope(*this);
+        std::unordered_map<int, Symbol> memo;
+        rewrite({s->id()}, memo, expandNode);
+        Symbol result = memo[s->id()];
+        collectIfNeeded();
+        return result;
     }
 
+    /**
+     * pulls the factor shared by most terms out of every sum reachable from
+     * s, repeatedly, so a polynomial ends up in a nested (horner) form:
+     * a + b*x + c*x*x -> a + x*(b + c*x).
+     */
     Symbol factor(const Symbol &s) {
-        // TODO: implement
-        return s;
+        Scope scope(*this);
+        std::unordered_map<int, Symbol> memo;
+        rewrite({s->id()}, memo, factorNode);
+        Symbol result = memo[s->id()];
+        collectIfNeeded();
+        return result;
+    }
+
+    /**
+     * estimated cost of the nodes reachable from roots, each shared node
+     * counted once, in units of a multiplication (see op_cost)
+     */
+    size_t flopCount(const std::vector<Symbol> &roots) const {
+        Scope scope(*this);
+        std::vector<int> ids;
+        for (auto &&r : roots) {
+            ids.push_back(r->id());
+        }
+        size_t cost = 0;
+        for (auto &&id : topologicalOrder(ids)) {
+            cost += nodeCost(id);
+        }
+        return cost;
+    }
+
+    // lets cxxCodePrinter replace the outputs by their expanded or factored forms where that is cheaper, see autoExpandFactor
+    void setAutoExpandFactor(bool enable) {
+        auto_expand_factor = enable;
+    }
+
+    /**
+     * replaces every output by the cheapest of itself, its expanded, factored
+     * and expanded then factored form. outputs are decided in order, a form
+     * costs the nodes it adds to those of the outputs decided before, so
+     * rewriting never loses subexpressions shared with them.
+     */
+    void autoExpandFactor() {
+        Scope scope(*this);
+        std::vector<Symbol*> outputs = outputSymbols();
+        std::vector<int> roots;
+        for (auto &&v : outputs) {
+            roots.push_back((*v)->id());
+        }
+        std::unordered_map<int, Symbol> expanded, factored, expanded_factored;
+        rewrite(roots, expanded, expandNode);
+        rewrite(roots, factored, factorNode);
+        std::vector<int> expanded_roots;
+        for (auto &&id : roots) {
+            expanded_roots.push_back(expanded[id]->id());
+        }
+        rewrite(expanded_roots, expanded_factored, factorNode);
+        std::vector<std::vector<Symbol>> candidates;
+        for (size_t k = 0; k < outputs.size(); k++) {
+            candidates.push_back({*outputs[k], expanded[roots[k]], factored[roots[k]],
+                                  expanded_factored[expanded_roots[k]]});
+        }
+        replaceByCheapest(outputs, candidates);
+        collectIfNeeded();
     }
 
-    Digraph digraph() const { return Digraph(rev_repr_map, depends_list, idMapping()); }
+    struct EGraphReport {
+        size_t num_nodes;  // of the e-graph when saturation stopped
+        bool saturated;  // no rule applied any more within the budget
+        size_t cost_before, cost_after;  // flopCount of the outputs
+    };
+
+    /**
+     * lets cxxCodePrinter run optimizeEGraph with this budget: saturation
+     * stops after max_iterations passes over the e-graph or once it has more
+     * than max_nodes nodes. 0 nodes disables. there is no time limit, so the
+     * printed code depends only on the graph and the budget
+     */
+    void setEGraphBudget(size_t max_nodes, int max_iterations = 16) {
+        egraph_max_nodes = max_nodes;
+        egraph_max_iterations = max_iterations;
+    }
+
+    const std::vector<EGraphReport> &egraphReports() const { return egraph_reports; }
+
+    /**
+     * equality saturation over the outputs. the nodes reachable from them
+     * are put into an EGraph, saturated under its algebraic and
+     * trigonometric rules within the budget of setEGraphBudget, and the
+     * cheapest form of each class under op_cost is extracted. an output is
+     * replaced only if its extracted form adds fewer nodes to the outputs
+     * decided before, as in autoExpandFactor
+     */
+    EGraphReport optimizeEGraph() {
+        Scope scope(*this);
+        std::vector<Symbol*> outputs = outputSymbols();
+        std::vector<int> roots;
+        std::vector<Symbol> before;
+        for (auto &&v : outputs) {
+            roots.push_back((*v)->id());
+            before.push_back(*v);
+        }
+        EGraph g;
+        std::unordered_map<int, int> classes;  // node -> class
+        for (auto &&id : topologicalOrder(roots)) {
+            NodeKey key{opcode(id), {}, 0, ""};
+            for (auto &&c : children(id)) {
+                key.args.push_back(classes[alias(c)]);
+            }
+            if (key.op == OpCode::CONSTANT) {
+                key.payload = to_bits(value(id));
+            } else if (key.op == OpCode::VARIABLE) {
+                key.name = repr(id);
+            }
+            classes[id] = g.add(key);
+        }
+        EGraphReport report{0, false, flopCount(before), 0};
+        report.saturated = g.saturate(egraph_max_nodes ? egraph_max_nodes : std::numeric_limits<size_t>::max(),
+                                      egraph_max_iterations, std::numeric_limits<double>::infinity());
+        report.num_nodes = g.numNodes();
+
+        std::vector<NodeKey> best = g.extract();
+        std::unordered_map<int, Symbol> built;  // class -> extracted node
+        std::vector<std::vector<Symbol>> candidates;
+        for (size_t k = 0; k < outputs.size(); k++) {
+            std::vector<int> stack{g.find(classes[roots[k]])};
+            while (stack.size()) {
+                int c = stack.back();
+                if (built.count(c)) {
+                    stack.pop_back();
+                    continue;
+                }
+                const NodeKey &n = best[c];
+                std::vector<Symbol> args;
+                for (auto &&a : n.args) {
+                    auto found = built.find(g.find(a));
+                    if (found == built.end()) {
+                        stack.push_back(g.find(a));
+                    } else {
+                        args.push_back(found->second);
+                    }
+                }
+                if (args.size() < n.args.size()) {
+                    continue;
+                }
+                stack.pop_back();
+                if (n.op == OpCode::CONSTANT) {
+                    built[c] = make_symbol<Constant>(from_bits(n.payload));
+                } else if (n.op == OpCode::VARIABLE) {
+                    built[c] = make_symbol<Variable>(n.name);
+                } else {
+                    built[c] = rebuild(n.op, args);
+                }
+            }
+            candidates.push_back({*outputs[k], built[g.find(classes[roots[k]])]});
+        }
+        replaceByCheapest(outputs, candidates);
+        std::vector<Symbol> after;
+        for (auto &&v : outputs) {
+            after.push_back(*v);
+        }
+        report.cost_after = flopCount(after);
+        egraph_reports.push_back(report);
+        collectIfNeeded();
+        return report;
+    }
+
+    // the nodes canonicalHash covers, children first
+    Digraph digraph() const {
+        Scope scope(*this);
+        return Digraph(reprList(), child_table, idMapping(), topologicalOrder(graphRoots()));
+    }
     CalculationGraph wholeGraph() const {
+        Scope scope(*this);
         std::unordered_map<int, std::string> input_nodes;
         std::unordered_map<std::string, int> output_nodes;
         for (auto &&[symbol, vlist] : static_inputs) {
             for (auto &&v : vlist) {
-                input_nodes[v->id()] = rev_repr_map[v->id()](rev_repr_map);
+                input_nodes[v->id()] = repr(v->id());
             }
         }
         for (auto &&[symbol, vlist] : dynamic_inputs) {
             for (auto &&v : vlist) {
-                input_nodes[v->id()] = rev_repr_map[v->id()](rev_repr_map);
+                input_nodes[v->id()] = repr(v->id());
             }
         }
         for (auto &&[symbol, ptr_vlist] : static_outputs) {
@@ -99,7 +793,8 @@ class Factory : public FactoryBase {
                 output_nodes[symbol + "[" + std::to_string(index) + "]"] = ptr_vlist->at(index)->id();
             }
         }
-        return CalculationGraph(input_nodes, output_nodes, rev_repr_map, depends_list, idMapping());
+        std::vector<Repr> repr_list = reprList();
+        return CalculationGraph(input_nodes, output_nodes, repr_list, child_table, idMapping());
     }
 
     // void simplified() {
@@ -122,6 +817,13 @@ class Factory : public FactoryBase {
     // }
 
     CxxCodePrinter cxxCodePrinter(const std::string &ns, const std::string &class_name) {
+        Scope scope(*this);
+        if (egraph_max_nodes) {
+            optimizeEGraph();
+        }
+        if (auto_expand_factor) {
+            autoExpandFactor();
+        }
         CxxCodePrinter printer(ns, class_name);
         // std::vector<std::string> static_variables, dynamic_variables;
         // for (auto &&[symbol, vlist] : static_inputs) {
@@ -137,23 +839,44 @@ class Factory : public FactoryBase {
         //     dynamic_variables.push_back(symbol);
         // }
 
-        std::vector<bool> dynamic_nodes(repr_map.size(), false);
-        std::vector<bool> intermediate_nodes(repr_map.size(), false);
-        for (size_t i = 0; i < whole_depends_list.size(); i++) {
-            for (auto &&[symbol, vlist] : dynamic_inputs) {
-                for (auto &&v : vlist) {
-                    if (whole_depends_list[i].find(v->id()) != whole_depends_list[i].end()) {
-                        dynamic_nodes[i] = true;
-                        break;
+        // only the nodes computed by operator(), not e.g. those of checkpointed gradients
+        std::vector<int> roots;
+        for (auto &&outputs : {&static_outputs, &dynamic_outputs}) {
+            for (auto &&[symbol, ptr_vlist] : *outputs) {
+                for (auto &&v : *ptr_vlist) {
+                    if (v) {
+                        roots.push_back(v->id());
                     }
                 }
             }
         }
+        std::vector<Repr> repr_list;
+        ChildTable table;
+        printLayout(roots, repr_list, table);
+
+        std::vector<bool> dynamic_nodes(table.size(), false);
+        std::vector<bool> intermediate_nodes(table.size(), false);
+        VariableSet dynamic_variable_set;
+        for (auto &&[symbol, vlist] : dynamic_inputs) {
+            for (auto &&v : vlist) {
+                dynamic_variable_set.insert(variableIndex(v->id()));
+            }
+        }
         for (size_t i = 0; i < dynamic_nodes.size(); i++) {
+            if (i < size()) {
+                dynamic_nodes[i] = variableDepends(i).intersects(dynamic_variable_set);
+                continue;
+            }
+            // a pair of the layout, its operands have lower ids
+            for (auto &&d : table[i]) {
+                dynamic_nodes[i] = dynamic_nodes[i] or dynamic_nodes[d];
+            }
+        }
+        for (auto &&i : topologicalOrder(roots, nullptr, &table)) {
             if (not dynamic_nodes[i]) {
                 continue;
             }
-            for (auto &&d : depends_list[i]) {
+            for (auto &&d : table[i]) {
                 if (dynamic_nodes[d]) {
                     continue;
                 }
@@ -174,12 +897,12 @@ class Factory : public FactoryBase {
 
         for (auto &&[symbol, vlist] : static_inputs) {
             for (auto &&v : vlist) {
-                static_input_nodes[v->id()] = rev_repr_map[v->id()](rev_repr_map);
+                static_input_nodes[v->id()] = repr(v->id());
             }
         }
         for (auto &&[symbol, vlist] : dynamic_inputs) {
             for (auto &&v : vlist) {
-                dynamic_input_nodes[v->id()] = rev_repr_map[v->id()](rev_repr_map);
+                dynamic_input_nodes[v->id()] = repr(v->id());
             }
         }
         for (auto &&[symbol, ptr_vlist] : static_outputs) {
@@ -212,7 +935,7 @@ class Factory : public FactoryBase {
             if (static_input_nodes.find(i) != static_input_nodes.end() or dynamic_input_nodes.find(i) != dynamic_input_nodes.end()) {
                 continue;
             }
-            if (FactoryBase::is<Constant>(i)) {
+            if (i < size() and FactoryBase::is<Constant>(i)) {
                 continue;
             }
             static_output_nodes["_i[" + std::to_string(num_intermediates) + "]"] = i;
@@ -220,22 +943,901 @@ class Factory : public FactoryBase {
             num_intermediates++;
         }
 
-        CalculationGraph static_dag(static_input_nodes, static_output_nodes, rev_repr_map, depends_list, idMapping());
-        CalculationGraph dynamic_dag(dynamic_input_nodes, dynamic_output_nodes, rev_repr_map, depends_list, idMapping());
+        CalculationGraph static_dag(static_input_nodes, static_output_nodes, repr_list, table, idMapping());
+        CalculationGraph dynamic_dag(dynamic_input_nodes, dynamic_output_nodes, repr_list, table, idMapping());
+        std::vector<std::tuple<int, int, int>> sin_cos = sinCosPairs(roots, table);
+        if (sin_cos.size()) {
+            static_dag.fuseSinCos(sin_cos);
+            dynamic_dag.fuseSinCos(sin_cos);
+            printer.addSinCosFunction();
+        }
         std::stringstream sd, dd;
         sd << static_dag;
         dd << dynamic_dag;
 
+        for (auto &&[symbol, pattern] : sparse_patterns) {
+            printer.addSparsePattern(symbol, pattern->rows, pattern->cols, pattern->row_offsets, pattern->col_indices,
+                                     pattern->num_colors, pattern->colors);
+        }
         printer.setStaticVariables(static_variables, num_intermediates, sd.str());
         printer.setDynamicVariables(dynamic_variables, dd.str());
+        for (auto &&g : checkpointed_gradients) {
+            printCheckpointedGradient(printer, g);
+            for (auto &&list : g.symbolLists()) {
+                for (auto &&v : *list) {
+                    roots.push_back(v->id());
+                }
+            }
+        }
+        for (auto &&id : topologicalOrder(roots)) {
+            if (opcode(id) == OpCode::POW) {
+                int n = std::abs(static_cast<const PowFunction*>(function(id))->chainExponent());
+                if (n > 3) {
+                    printer.addPowerFunction(n);
+                }
+            }
+        }
 
         return printer;
     }
 
+    // structural hash of the nodes reachable from the inputs and outputs, of the bindings and of the options
+    // cxxCodePrinter depends on, independent of node ids
+    uint64_t canonicalHash() const {
+        Scope scope(*this);
+        std::vector<Binding> bindings = this->bindings();
+        std::vector<uint64_t> hashes = nodeHashes(graphRoots());
+        uint64_t h = fnv1a(bindings.size());
+        for (auto &&b : bindings) {
+            h = fnv1a(static_cast<uint8_t>(b.tag), h);
+            h = fnv1a(b.is_input, h);
+            h = fnv1a(b.name, h);
+            if (b.pattern) {
+                h = fnv1a(b.pattern->rows, h);
+                h = fnv1a(b.pattern->cols, h);
+                for (auto &&v : b.pattern->row_offsets) {
+                    h = fnv1a(v, h);
+                }
+                for (auto &&v : b.pattern->col_indices) {
+                    h = fnv1a(v, h);
+                }
+                for (auto &&v : b.pattern->colors) {
+                    h = fnv1a(v, h);
+                }
+            }
+            for (auto &&id : b.nodes) {
+                h = fnv1a(id >= 0 ? hashes[alias(id)] : ~uint64_t(0), h);
+            }
+        }
+        for (auto &&g : checkpointed_gradients) {
+            h = fnv1a(g.name, h);
+            h = fnv1a(g.num_steps, h);
+            h = fnv1a(g.num_checkpoints, h);
+            for (auto &&list : g.symbolLists()) {
+                h = fnv1a(list->size(), h);
+                for (auto &&v : *list) {
+                    h = fnv1a(hashes[v->id()], h);
+                }
+            }
+        }
+        h = fnv1a(auto_expand_factor, h);
+        h = fnv1a(egraph_max_nodes, h);
+        if (egraph_max_nodes) {
+            h = fnv1a(egraph_max_iterations, h);
+        }
+        return h;
+    }
+
+ protected:
+    // a product that would expand into more terms is kept
+    static constexpr size_t max_expanded_terms = 64;
+
+    // sign * coefficient * prod base^exponent, a term of factorSum
+    struct Monomial {
+        double coefficient;
+        std::vector<std::tuple<Symbol, int>> factors;
+    };
+
+    // memo[id] = rule(node id over the rewritten children) for the nodes reachable from roots
+    template<class Rule>
+    void rewrite(const std::vector<int> &roots, std::unordered_map<int, Symbol> &memo, Rule rule) const {
+        for (auto &&id : topologicalOrder(roots)) {
+            if (memo.count(id)) {
+                continue;
+            }
+            std::vector<Symbol> args;
+            bool changed = false;
+            for (auto &&c : children(id)) {
+                args.push_back(memo[alias(c)]);
+                changed = changed or args.back()->id() != alias(c);
+            }
+            if (args.empty()) {
+                memo[id] = Symbol::fromId(id);
+            } else {
+                memo[id] = rule(changed ? rebuild(opcode(id), args) : Symbol::fromId(id));
+            }
+        }
+    }
+
+    // whether a node of kind op can have num_children children
+    static bool validNumChildren(OpCode op, size_t num_children) {
+        switch (op) {
+            case OpCode::CONSTANT:
+            case OpCode::VARIABLE:
+                return num_children == 0;
+            case OpCode::NEG:
+            case OpCode::SIN:
+            case OpCode::COS:
+            case OpCode::SQRT:
+            case OpCode::EXP:
+            case OpCode::LOG:
+            case OpCode::ASIN:
+            case OpCode::ACOS:
+                return num_children == 1;
+            case OpCode::ADD:
+            case OpCode::MUL:
+                return num_children > 0;
+            case OpCode::SUB:
+            case OpCode::DIV:
+            case OpCode::ATAN2:
+            case OpCode::POW:
+                return num_children == 2;
+            default:
+                return false;
+        }
+    }
+
+    // the node of kind op over args, with the children in the order of children()
+    static Symbol rebuild(OpCode op, const std::vector<Symbol> &args) {
+        switch (op) {
+            case OpCode::NEG: return make_symbol<NegFunction>(args[0]);
+            case OpCode::SIN: return make_symbol<SinFunction>(args[0]);
+            case OpCode::COS: return make_symbol<CosFunction>(args[0]);
+            case OpCode::SQRT: return make_symbol<SquareRootFunction>(args[0]);
+            case OpCode::EXP: return make_symbol<ExpFunction>(args[0]);
+            case OpCode::LOG: return make_symbol<LogFunction>(args[0]);
+            case OpCode::ASIN: return make_symbol<ArcSinFunction>(args[0]);
+            case OpCode::ACOS: return make_symbol<ArcCosFunction>(args[0]);
+            case OpCode::ADD: return make_symbol<AddFunction>(args);
+            case OpCode::SUB: return make_symbol<SubFunction>(args[0], args[1]);
+            case OpCode::MUL: return make_symbol<MulFunction>(args);
+            case OpCode::DIV: return make_symbol<DivFunction>(args[1]);
+            case OpCode::ATAN2: return make_symbol<Atan2Function>(args[0], args[1]);
+            case OpCode::POW: return make_symbol<PowFunction>(args[0], args[1]);
+            default:
+                throw std::runtime_error("node without children can not be rebuilt");
+        }
+    }
+
+    static Symbol child(const Symbol &s, size_t k) {
+        return Symbol::fromId(alias(children(s->id())[k]));
+    }
+
+    // appends s as terms of a sum, negative flips the sign of every term
+    static void signedTerms(const Symbol &s, bool negative, std::vector<std::tuple<Symbol, bool>> &terms) {
+        switch (opcode(s->id())) {
+            case OpCode::ADD:
+                for (size_t k = 0; k < children(s->id()).size(); k++) {
+                    signedTerms(child(s, k), negative, terms);
+                }
+                break;
+            case OpCode::SUB:
+                signedTerms(child(s, 0), negative, terms);
+                signedTerms(child(s, 1), not negative, terms);
+                break;
+            case OpCode::NEG:
+                signedTerms(child(s, 0), not negative, terms);
+                break;
+            default:
+                terms.emplace_back(s, negative);
+        }
+    }
+
+    static Symbol signedSum(const std::vector<std::tuple<Symbol, bool>> &terms) {
+        std::vector<Symbol> positives, negatives;
+        for (auto &&[t, negative] : terms) {
+            (negative ? negatives : positives).push_back(t);
+        }
+        if (negatives.empty()) {
+            return sum(positives);
+        }
+        return make_symbol<SubFunction>(sum(positives), sum(negatives));
+    }
+
+    // products and integer powers of sums become sums of products
+    static Symbol expandNode(const Symbol &s) {
+        std::vector<Symbol> factors;
+        if (opcode(s->id()) == OpCode::MUL) {
+            for (size_t k = 0; k < children(s->id()).size(); k++) {
+                factors.push_back(child(s, k));
+            }
+        } else if (opcode(s->id()) == OpCode::POW) {
+            int n = static_cast<const PowFunction*>(function(s->id()))->chainExponent();
+            if (n < 2) {
+                return s;
+            }
+            factors.assign(n, child(s, 0));
+        } else {
+            return s;
+        }
+        std::vector<std::vector<std::tuple<Symbol, bool>>> factor_terms(factors.size());
+        size_t num_terms = 1;
+        for (size_t k = 0; k < factors.size(); k++) {
+            signedTerms(factors[k], false, factor_terms[k]);
+            num_terms *= factor_terms[k].size();
+            if (num_terms > max_expanded_terms) {
+                return s;
+            }
+        }
+        if (num_terms == 1) {
+            return s;
+        }
+        std::vector<std::tuple<Symbol, bool>> terms;
+        for (size_t i = 0; i < num_terms; i++) {
+            std::vector<Symbol> p;
+            bool negative = false;
+            for (size_t k = 0, r = i; k < factors.size(); r /= factor_terms[k].size(), k++) {
+                auto &&[t, n] = factor_terms[k][r % factor_terms[k].size()];
+                p.push_back(t);
+                negative = negative != n;
+            }
+            terms.emplace_back(product(p), negative);
+        }
+        return signedSum(terms);
+    }
+
+    static Symbol factorNode(const Symbol &s) {
+        if (opcode(s->id()) != OpCode::ADD and opcode(s->id()) != OpCode::SUB) {
+            return s;
+        }
+        std::vector<std::tuple<Symbol, bool>> terms;
+        signedTerms(s, false, terms);
+        std::vector<Monomial> monomials;
+        for (auto &&[t, negative] : terms) {
+            Monomial m{negative ? -1.0 : 1.0, {}};
+            std::vector<Symbol> operands{t};
+            if (opcode(t->id()) == OpCode::MUL) {
+                operands = static_cast<const MulFunction*>(function(t->id()))->operands();
+            }
+            for (auto o : operands) {
+                if (opcode(o->id()) == OpCode::NEG) {
+                    m.coefficient = -m.coefficient;
+                    o = child(o, 0);
+                }
+                int n = opcode(o->id()) == OpCode::POW ? static_cast<const PowFunction*>(function(o->id()))->chainExponent() : 0;
+                if (is_constant(o)) {
+                    m.coefficient *= value(o->id());
+                } else if (n > 1) {
+                    m.factors.emplace_back(child(o, 0), n);
+                } else {
+                    m.factors.emplace_back(o, 1);
+                }
+            }
+            monomials.push_back(m);
+        }
+        return factorSum(monomials);
+    }
+
+    // the base shared by most terms is pulled out with its smallest exponent, then the same for both parts
+    static Symbol factorSum(std::vector<Monomial> terms) {
+        std::map<int, size_t> counts;
+        for (auto &&t : terms) {
+            for (auto &&[base, e] : t.factors) {
+                counts[base->id()]++;
+            }
+        }
+        int best = -1;
+        size_t best_count = 1;
+        for (auto &&[base, count] : counts) {
+            if (count > best_count) {
+                best = base;
+                best_count = count;
+            }
+        }
+        if (best < 0) {
+            std::vector<std::tuple<Symbol, bool>> result;
+            for (auto &&t : terms) {
+                std::vector<Symbol> p;
+                if (std::abs(t.coefficient) != 1 or t.factors.empty()) {
+                    p.push_back(make_symbol<Constant>(std::abs(t.coefficient)));
+                }
+                for (auto &&[base, e] : t.factors) {
+                    p.push_back(e == 1 ? base : pow(base, double(e)));
+                }
+                result.emplace_back(product(p), t.coefficient < 0);
+            }
+            return signedSum(result);
+        }
+        std::vector<Monomial> with, rest;
+        int common = std::numeric_limits<int>::max();
+        for (auto &&t : terms) {
+            auto found = std::find_if(t.factors.begin(), t.factors.end(),
+                                      [&](const std::tuple<Symbol, int> &f) { return std::get<0>(f)->id() == best; });
+            if (found == t.factors.end()) {
+                rest.push_back(t);
+            } else {
+                common = std::min(common, std::get<1>(*found));
+                with.push_back(t);
+            }
+        }
+        for (auto &&t : with) {
+            for (auto iter = t.factors.begin(); iter != t.factors.end(); ++iter) {
+                if (std::get<0>(*iter)->id() == best) {
+                    std::get<1>(*iter) -= common;
+                    if (std::get<1>(*iter) == 0) {
+                        t.factors.erase(iter);
+                    }
+                    break;
+                }
+            }
+        }
+        Symbol base = Symbol::fromId(best);
+        Symbol result = make_symbol<MulFunction>(common == 1 ? base : pow(base, double(common)), factorSum(with));
+        if (rest.empty()) {
+            return result;
+        }
+        return make_symbol<AddFunction>(result, factorSum(rest));
+    }
+
+    static size_t nodeCost(int id) {
+        int exponent = 0;
+        if (opcode(id) == OpCode::POW) {
+            exponent = static_cast<const PowFunction*>(function(id))->chainExponent();
+        }
+        return op_cost(opcode(id), children(id).size(), exponent);
+    }
+
+    std::vector<Symbol*> outputSymbols() {
+        std::vector<Symbol*> result;
+        for (auto &&list : {&static_outputs, &dynamic_outputs}) {
+            for (auto &&[symbol, ptr_vlist] : *list) {
+                for (auto &&v : *ptr_vlist) {
+                    if (v) {
+                        result.push_back(&v);
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    /**
+     * outputs[k] becomes the candidate that adds the fewest nodes to those of
+     * the outputs before it, candidates[k][0] on ties. the choice ignores the
+     * outputs after it, so all outputs are kept if the total gets worse
+     */
+    void replaceByCheapest(const std::vector<Symbol*> &outputs, const std::vector<std::vector<Symbol>> &candidates) {
+        std::vector<Symbol> before, after;
+        std::vector<uint8_t> counted;
+        for (size_t k = 0; k < outputs.size(); k++) {
+            before.push_back(*outputs[k]);
+            counted.resize(size(), 0);
+            size_t best = 0, best_cost = 0;
+            for (size_t c = 0; c < candidates[k].size(); c++) {
+                size_t cost = addedCost(candidates[k][c]->id(), counted, false);
+                if (c == 0 or cost < best_cost) {
+                    best = c;
+                    best_cost = cost;
+                }
+            }
+            addedCost(candidates[k][best]->id(), counted, true);
+            after.push_back(candidates[k][best]);
+        }
+        if (flopCount(after) < flopCount(before)) {
+            for (size_t k = 0; k < outputs.size(); k++) {
+                *outputs[k] = after[k];
+            }
+        }
+    }
+
+    // cost of the nodes reachable from root that are not counted yet, commit marks them as counted
+    size_t addedCost(int root, std::vector<uint8_t> &counted, bool commit) const {
+        std::vector<int> stack{root}, visited;
+        size_t cost = 0;
+        while (stack.size()) {
+            int id = stack.back();
+            stack.pop_back();
+            if (counted[id]) {
+                continue;
+            }
+            counted[id] = 1;
+            visited.push_back(id);
+            cost += nodeCost(id);
+            for (auto &&c : children(id)) {
+                stack.push_back(alias(c));
+            }
+        }
+        if (not commit) {
+            for (auto &&id : visited) {
+                counted[id] = 0;
+            }
+        }
+        return cost;
+    }
+
+    // an Input or Output, in registration order
+    struct Binding {
+        IOTag tag;
+        bool is_input;
+        std::string name;
+        std::vector<int> nodes;  // -1 for an unset output
+        const SparsePattern *pattern;  // nullptr unless a sparse output
+    };
+
+    const SparsePattern *sparsePattern(const std::string &symbol) const {
+        for (auto &&[name, pattern] : sparse_patterns) {
+            if (name == symbol) {
+                return pattern;
+            }
+        }
+        return nullptr;
+    }
+
+    std::vector<Binding> bindings() const {
+        std::vector<Binding> result;
+        auto add_bindings = [&](IOTag tag, const std::vector<std::tuple<bool, std::string>> &variables,
+                                const std::vector<std::tuple<std::string, std::vector<Symbol>>> &inputs,
+                                const std::vector<std::tuple<std::string, std::vector<Symbol>*>> &outputs) {
+            size_t input_index = 0, output_index = 0;
+            for (auto &&[is_input, symbol] : variables) {
+                Binding b{tag, is_input, symbol, {}, is_input ? nullptr : sparsePattern(symbol)};
+                if (is_input) {
+                    for (auto &&v : std::get<1>(inputs[input_index++])) {
+                        b.nodes.push_back(v->id());
+                    }
+                } else {
+                    for (auto &&v : *std::get<1>(outputs[output_index++])) {
+                        b.nodes.push_back(v ? v->id() : -1);
+                    }
+                }
+                result.push_back(b);
+            }
+        };
+        add_bindings(IOTag::STATIC, static_variables, static_inputs, static_outputs);
+        add_bindings(IOTag::DYNAMIC, dynamic_variables, dynamic_inputs, dynamic_outputs);
+        return result;
+    }
+
+    static std::vector<int> bindingNodes(const std::vector<Binding> &bindings) {
+        std::vector<int> result;
+        for (auto &&b : bindings) {
+            std::copy_if(b.nodes.begin(), b.nodes.end(), std::back_inserter(result), [](int id) { return id >= 0; });
+        }
+        return result;
+    }
+
+    // the nodes of the inputs, outputs and checkpointed gradients
+    std::vector<int> graphRoots() const {
+        std::vector<int> roots = bindingNodes(bindings());
+        for (auto &&g : checkpointed_gradients) {
+            for (auto &&list : g.symbolLists()) {
+                for (auto &&v : *list) {
+                    roots.push_back(v->id());
+                }
+            }
+        }
+        return roots;
+    }
+
+    /**
+     * structural hash of every node reachable from roots, indexed by id. the
+     * operands of a sum or product are hashed in the order they are printed,
+     * which decides how the result is rounded
+     */
+    std::vector<uint64_t> nodeHashes(const std::vector<int> &roots) const {
+        std::vector<uint64_t> hashes(size(), 0);
+        for (auto &&id : topologicalOrder(roots)) {
+            uint64_t h = fnv1a(static_cast<uint8_t>(opcode(id)));
+            if (opcode(id) == OpCode::CONSTANT) {
+                h = fnv1a(to_bits(value(id)), h);
+            } else if (opcode(id) == OpCode::VARIABLE) {
+                h = fnv1a(repr(id), h);
+            }
+            for (auto &&c : children(id)) {
+                h = fnv1a(hashes[alias(c)], h);
+            }
+            hashes[id] = h;
+        }
+        return hashes;
+    }
+
+    // nodes reachable from roots, children before parents. if wrt is given,
+    // only nodes that depend on one of its variables are visited. table
+    // replaces the children of the nodes, e.g. by a print layout, whose ids
+    // past size() are its own nodes
+    std::vector<int> topologicalOrder(const std::vector<int> &roots, const VariableSet *wrt = nullptr,
+                                      const ChildTable *table = nullptr) const {
+        std::vector<int> order;
+        std::vector<uint8_t> state(table ? table->size() : size(), 0);  // 0: unvisited, 1: open, 2: done
+        std::vector<std::tuple<int, size_t>> stack;
+        auto visit = [&](int id) {
+            id = id < static_cast<int>(size()) ? alias(id) : id;
+            if (state[id] or (wrt and not variableDepends(id).intersects(*wrt))) {
+                return;
+            }
+            state[id] = 1;
+            stack.emplace_back(id, 0);
+        };
+        for (auto &&root : roots) {
+            visit(root);
+            while (stack.size()) {
+                auto &[id, k] = stack.back();
+                ChildTable::Range c = table ? (*table)[id] : children(id);
+                if (k < c.size()) {
+                    visit(c[k++]);
+                    continue;
+                }
+                state[id] = 2;
+                order.push_back(id);
+                stack.pop_back();
+            }
+        }
+        return order;
+    }
+
+    // (a, sin(a), cos(a)) for each argument a both sin and cos of are reachable from roots
+    std::vector<std::tuple<int, int, int>> sinCosPairs(const std::vector<int> &roots, const ChildTable &table) const {
+        std::map<int, std::tuple<int, int>> found;
+        for (auto &&id : topologicalOrder(roots, nullptr, &table)) {
+            if (id >= static_cast<int>(size())) {
+                continue;  // a pair of the layout
+            }
+            if (opcode(id) == OpCode::SIN or opcode(id) == OpCode::COS) {
+                auto &[s, c] = found.emplace(alias(table[id][0]), std::make_tuple(-1, -1)).first->second;
+                (opcode(id) == OpCode::SIN ? s : c) = id;
+            }
+        }
+        std::vector<std::tuple<int, int, int>> result;
+        for (auto &&[arg, p] : found) {
+            auto [s, c] = p;
+            if (s >= 0 and c >= 0) {
+                result.emplace_back(arg, s, c);
+            }
+        }
+        return result;
+    }
+
+    /**
+     * reprs and children of the printed code over the nodes reachable from
+     * roots. a sum or product is printed with one operation per operand, so
+     * an operand pair shared by several of them is computed once: the most
+     * frequent pair becomes a node of its own and replaces the pair wherever
+     * it occurs, until no pair occurs twice. a pair that is no node yet gets
+     * an id from size() on, which only repr_list and table know of, so
+     * printing leaves the factory as it is. operands keep their order and a
+     * pair takes the place of its first operand, ties between pairs are
+     * broken by their structural hashes, so the layout depends on nothing
+     * canonicalHash does not cover.
+     */
+    void printLayout(const std::vector<int> &roots, std::vector<Repr> &repr_list, ChildTable &table) const {
+        // the pairs of longer operand lists are not counted, they are quadratic in the length
+        static constexpr size_t max_operands = 32;
+        std::vector<uint64_t> hashes = nodeHashes(roots);
+        std::vector<int> nodes;
+        std::vector<std::vector<int>> operands;
+        std::unordered_map<int, std::vector<int>> occurrences;  // operand -> indices into nodes
+        std::unordered_map<uint64_t, int> existing;  // pair -> the node of the pair
+        for (auto &&id : topologicalOrder(roots)) {
+            ChildTable::Range c = children(id);
+            if ((opcode(id) != OpCode::ADD and opcode(id) != OpCode::MUL) or c.size() > max_operands) {
+                continue;
+            }
+            std::vector<int> o;
+            for (auto &&d : c) {
+                o.push_back(alias(d));
+            }
+            std::vector<int> distinct(o);
+            std::sort(distinct.begin(), distinct.end());
+            distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+            for (auto &&d : distinct) {
+                occurrences[d].push_back(nodes.size());
+            }
+            nodes.push_back(id);
+            operands.push_back(std::move(o));
+        }
+
+        auto pair_key = [](OpCode op, int a, int b) {
+            return (uint64_t(op == OpCode::MUL) << 62) | (uint64_t(a) << 31) | uint64_t(b);
+        };
+        for (size_t n = 0; n < nodes.size(); n++) {
+            if (operands[n].size() == 2) {
+                existing.emplace(pair_key(opcode(nodes[n]), operands[n][0], operands[n][1]), nodes[n]);
+            }
+        }
+        std::unordered_map<uint64_t, int> counts;
+        // count, then the structural hashes of the operands, then the key
+        std::priority_queue<std::tuple<int, uint64_t, uint64_t, uint64_t>> heap;
+        auto count = [&](size_t n, int delta) {
+            std::vector<uint64_t> keys;
+            const std::vector<int> &o = operands[n];
+            for (size_t i = 0; i < o.size(); i++) {
+                for (size_t j = i + 1; j < o.size(); j++) {
+                    keys.push_back(pair_key(opcode(nodes[n]), o[i], o[j]));
+                }
+            }
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            for (auto &&key : keys) {
+                int &c = counts[key];
+                c += delta;
+                if (delta > 0 and c > 1) {
+                    heap.emplace(c, hashes[(key >> 31) & 0x7fffffff], hashes[key & 0x7fffffff], key);
+                }
+            }
+        };
+        for (size_t n = 0; n < nodes.size(); n++) {
+            count(n, 1);
+        }
+
+        std::unordered_map<int, std::vector<int>> layout;
+        std::vector<OpCode> pair_ops;  // of the ids from size() on
+        while (heap.size()) {
+            auto [c, ha, hb, key] = heap.top();
+            heap.pop();
+            if (counts[key] != c) {
+                continue;  // outdated
+            }
+            OpCode op = (key >> 62) ? OpCode::MUL : OpCode::ADD;
+            int a = (key >> 31) & 0x7fffffff, b = key & 0x7fffffff;
+            counts[key] = 0;
+            auto found = existing.find(key);
+            int id;
+            if (found != existing.end()) {
+                id = found->second;
+            } else {
+                id = size() + pair_ops.size();
+                pair_ops.push_back(op);
+                layout[id] = {a, b};
+                hashes.push_back(fnv1a(hb, fnv1a(ha, fnv1a(static_cast<uint8_t>(op)))));
+            }
+            std::vector<int> candidates = occurrences[occurrences[a].size() < occurrences[b].size() ? a : b];
+            for (auto &&n : candidates) {
+                std::vector<int> &o = operands[n];
+                if (opcode(nodes[n]) != op or o.size() <= 2) {
+                    continue;  // a pair is the node itself
+                }
+                bool replaced = false;
+                while (true) {
+                    std::vector<int> rest(o);
+                    auto ia = std::find(rest.begin(), rest.end(), a);
+                    if (ia == rest.end()) {
+                        break;
+                    }
+                    size_t position = ia - rest.begin();
+                    rest.erase(ia);
+                    auto ib = std::find(rest.begin(), rest.end(), b);
+                    if (ib == rest.end()) {
+                        break;
+                    }
+                    position = std::min<size_t>(position, ib - rest.begin());
+                    rest.erase(ib);
+                    rest.insert(rest.begin() + position, id);
+                    if (not replaced) {
+                        count(n, -1);
+                        replaced = true;
+                    }
+                    o.swap(rest);
+                }
+                if (replaced) {
+                    count(n, 1);
+                    occurrences[id].push_back(n);
+                    layout[nodes[n]] = o;
+                }
+            }
+        }
+
+        repr_list = reprList();
+        repr_list.resize(size() + pair_ops.size());
+        for (auto &&[id, o] : layout) {
+            OpCode op = id < static_cast<int>(size()) ? opcode(id) : pair_ops[id - size()];
+            Repr r = _repr("(");
+            for (size_t k = 0; k < o.size(); k++) {
+                if (k > 0) {
+                    r.items.emplace_back(op == OpCode::ADD ? "+" : "*");
+                }
+                r.items.emplace_back(o[k]);
+            }
+            r.items.emplace_back(")");
+            repr_list[id] = r;
+        }
+        for (size_t i = 0; i < repr_list.size(); i++) {
+            auto found = layout.find(i);
+            if (found != layout.end()) {
+                table.push_back(found->second);
+            } else {
+                ChildTable::Range c = child_table[i];
+                table.push_back(std::vector<int>(c.begin(), c.end()));
+            }
+        }
+    }
+
+    // func->diff(var). once it adds more than diff_node_budget nodes it is stopped, reported and built through the local partials
+    Symbol budgetedDiff(const Symbol &func, const Symbol &var) {
+        if (diff_node_budget == 0) {
+            return func->diff(var);
+        }
+        size_t inserted_before = insertedNodes();
+        FactoryBase::setDiffNodeLimit(diff_node_budget);
+        try {
+            Symbol result = func->diff(var);
+            FactoryBase::setDiffNodeLimit(0);
+            return result;
+        } catch (...) {
+            FactoryBase::setDiffNodeLimit(0);
+            if (insertedNodes() - inserted_before <= diff_node_budget) {
+                throw;
+            }
+        }
+        std::string function = func->repr();
+        if (function.size() > 80) {
+            function = function.substr(0, 77) + "...";
+        }
+        {
+            std::lock_guard<std::mutex> lock(swell_mutex);
+            swell_reports.push_back({function, var->repr(), insertedNodes() - inserted_before});
+        }
+        bool previous = FactoryBase::setThreadDiffThroughPartials(true);
+        try {
+            Symbol result = func->diff(var);
+            FactoryBase::setThreadDiffThroughPartials(previous);
+            return result;
+        } catch (...) {
+            FactoryBase::setThreadDiffThroughPartials(previous);
+            throw;
+        }
+    }
+
+    // see addCheckpointedGradient, the state is the variables _x[i] and its adjoint _a[i]
+    struct CheckpointedGradient {
+        std::string name;
+        int num_steps{0}, num_checkpoints{0};
+        std::vector<Symbol> initial, wrt, step, step_adjoint, step_gradient, loss, loss_adjoint, loss_gradient, initial_gradient;
+
+        std::vector<const std::vector<Symbol>*> symbolLists() const {
+            return {&initial, &wrt, &step, &step_adjoint, &step_gradient, &loss, &loss_adjoint, &loss_gradient, &initial_gradient};
+        }
+    };
+
+    // assignments of the nodes to the names, every variable is read by its name
+    std::string printAssignments(const std::vector<std::tuple<std::string, Symbol>> &assignments) const {
+        std::unordered_map<int, std::string> input_nodes;
+        for (size_t i = 0; i < size(); i++) {
+            if (alias(i) == static_cast<int>(i) and opcode(i) == OpCode::VARIABLE) {
+                input_nodes[i] = repr(i);
+            }
+        }
+        std::unordered_map<std::string, int> output_nodes;
+        std::vector<int> roots;
+        for (auto &&[name, v] : assignments) {
+            if (v->repr() != name) {  // an accumulated gradient without contribution
+                output_nodes[name] = v->id();
+                roots.push_back(v->id());
+            }
+        }
+        std::vector<Repr> repr_list;
+        ChildTable table;
+        printLayout(roots, repr_list, table);
+        std::stringstream ss;
+        ss << CalculationGraph(input_nodes, output_nodes, repr_list, table, idMapping());
+        return ss.str();
+    }
+
+    void printCheckpointedGradient(CxxCodePrinter &printer, const CheckpointedGradient &g) const {
+        std::string n = std::to_string(g.initial.size()), prefix = "_" + g.name;
+        std::string args, call, gradient = g.name + "_gradient";
+        for (auto &&[symbol, vlist] : dynamic_inputs) {
+            args += "const ProbeScalar *" + symbol + ", ";
+            call += symbol + ", ";
+        }
+        auto indexed = [](const std::string &name, size_t i) { return name + "[" + std::to_string(i) + "]"; };
+        auto copy = [&](const std::string &dst, const std::string &src, const std::string &indent = "        ") {
+            return indent + "for (int i = 0; i < " + n + "; i++) {\n" +
+                indent + "    " + dst + "[i] = " + src + "[i];\n" +
+                indent + "}\n";
+        };
+        auto add = [&](const std::string &type, const std::string &name, const std::string &function_args,
+                       const std::string &contents) {
+            CxxCodePrinter::CxxFunction f;
+            f.type = type;
+            f.name = name;
+            f.args = function_args;
+            f.contents = contents;
+            f.is_const = type != "static int";
+            printer.addFunction(f);
+        };
+        std::vector<std::tuple<std::string, Symbol>> initial, step, adjoint, loss, initial_adjoint;
+        for (size_t i = 0; i < g.initial.size(); i++) {
+            initial.emplace_back(indexed("_x", i), g.initial[i]);
+            step.emplace_back(indexed("_y", i), g.step[i]);
+            adjoint.emplace_back(indexed("_b", i), g.step_adjoint[i]);
+            loss.emplace_back(indexed("_a", i), g.loss_adjoint[i]);
+        }
+        loss.emplace_back(g.name + "_value[0]", g.loss[0]);
+        for (size_t j = 0; j < g.wrt.size(); j++) {
+            adjoint.emplace_back(indexed(gradient, j), g.step_gradient[j]);
+            loss.emplace_back(indexed(gradient, j), g.loss_gradient[j]);
+            initial_adjoint.emplace_back(indexed(gradient, j), g.initial_gradient[j]);
+        }
+
+        add("void", prefix + "_initial", args + "IntermediateScalar *_x", printAssignments(initial));
+        add("void", prefix + "_step", args + "IntermediateScalar *_x",
+            "        IntermediateScalar _y[" + n + "];\n" + printAssignments(step) + copy("_x", "_y"));
+        add("void", prefix + "_adjoint",
+            args + "const IntermediateScalar *_x, IntermediateScalar *_a, ProbeScalar *" + gradient,
+            "        IntermediateScalar _b[" + n + "];\n" + printAssignments(adjoint) + copy("_a", "_b"));
+        add("void", prefix + "_loss",
+            args + "const IntermediateScalar *_x, IntermediateScalar *_a, ProbeScalar *" + g.name + "_value, ProbeScalar *" + gradient,
+            printAssignments(loss));
+        add("void", prefix + "_initial_adjoint", args + "const IntermediateScalar *_a, ProbeScalar *" + gradient,
+            printAssignments(initial_adjoint));
+        // with s snapshots and r recomputations of each step, beta(s, r) = (s + r)! / (s! r!) steps can be reversed.
+        // the first snapshot leaves beta(s - 1, r) steps to the right
+        add("static int", prefix + "_split", "int steps, int snapshots",
+            "        auto beta = [](int s, int r) {\n"
+            "            double b = 1;\n"
+            "            for (int i = 1; i <= s; i++) {\n"
+            "                b = b * (r + i) / i;\n"
+            "            }\n"
+            "            return b;\n"
+            "        };\n"
+            "        int r = 0;\n"
+            "        while (beta(snapshots, r) < steps) {\n"
+            "            r++;\n"
+            "        }\n"
+            "        double right = beta(snapshots - 1, r);\n"
+            "        int m = right >= steps ? 1 : steps - int(right);\n"
+            "        return m < 1 ? 1 : (m > steps - 1 ? steps - 1 : m);\n");
+        // reverses the steps [t0, t1) from the state at t0, _a is the adjoint of the state at t1 and then at t0.
+        // _c is a snapshot of its own, so snapshots more calls can be nested
+        add("void", prefix + "_reverse",
+            args + "int t0, int t1, const IntermediateScalar *_x, IntermediateScalar *_a, ProbeScalar *" + gradient + ", int snapshots",
+            "        IntermediateScalar _c[" + n + "];\n"
+            "        while (t1 > t0) {\n"
+            "            int m = " + prefix + "_split(t1 - t0, snapshots + 1);\n" +
+            copy("_c", "_x", "            ") +
+            "            for (int t = 0; t < m; t++) {\n"
+            "                " + prefix + "_step(" + call + "_c);\n"
+            "            }\n"
+            "            if (t1 - t0 - m == 1) {\n"
+            "                " + prefix + "_adjoint(" + call + "_c, _a, " + gradient + ");\n"
+            "            } else {\n"
+            "                " + prefix + "_reverse(" + call + "t0 + m, t1, _c, _a, " + gradient + ", snapshots - 1);\n"
+            "            }\n"
+            "            t1 = t0 + m;\n"
+            "        }\n");
+        add("void", g.name, args + "ProbeScalar *" + g.name + "_value, ProbeScalar *" + gradient,
+            "        IntermediateScalar _x0[" + n + "], _x[" + n + "], _a[" + n + "];\n"
+            "        " + prefix + "_initial(" + call + "_x0);\n" + copy("_x", "_x0") +
+            "        for (int t = 0; t < " + std::to_string(g.num_steps) + "; t++) {\n"
+            "            " + prefix + "_step(" + call + "_x);\n"
+            "        }\n"
+            "        " + prefix + "_loss(" + call + "_x, _a, " + g.name + "_value, " + gradient + ");\n"
+            "        " + prefix + "_reverse(" + call + "0, " + std::to_string(g.num_steps) + ", _x0, _a, " + gradient + ", " +
+            std::to_string(g.num_checkpoints) + ");\n"
+            "        " + prefix + "_initial_adjoint(" + call + "_a, " + gradient + ");\n");
+    }
+
+    // safe point, no node is under construction and no worker of parallelFor is running
+    void collectIfNeeded() {
+        if (collection_threshold and parallel_depth == 0 and size() > size_after_collection + collection_threshold) {
+            collect();
+        }
+    }
+
  protected:
+    size_t collection_threshold{0}, size_after_collection{0}, diff_node_budget{0};
+    bool auto_expand_factor{false};
+    size_t egraph_max_nodes{0};
+    int egraph_max_iterations{16};
+    std::vector<EGraphReport> egraph_reports;
+    std::vector<SwellReport> swell_reports;
+    std::mutex swell_mutex;
+    std::atomic<int> parallel_depth{0};
     std::vector<std::tuple<std::string, std::vector<Symbol>>> static_inputs, dynamic_inputs;
     std::vector<std::tuple<std::string, std::vector<Symbol>*>> static_outputs, dynamic_outputs;
     std::vector<std::tuple<bool, std::string>> static_variables, dynamic_variables;
+    std::vector<std::tuple<std::string, const SparsePattern*>> sparse_patterns;
+    std::vector<CheckpointedGradient> checkpointed_gradients;
 };
 
 } // namespace sym
@@ -8,141 +8,545 @@
 #ifndef FACTORY_BASE_HPP_
 #define FACTORY_BASE_HPP_
 
+#include <array>
+#include <mutex>
 #include <memory>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+#include <functional>
 #include <unordered_set>
 #include <unordered_map>
 
 #include "repr.hpp"
+#include "segmented_vector.hpp"
 
 namespace sym {
 
 class Function;
 
+// the values are stored in saved graphs, only append new ones
+enum class OpCode : uint8_t {
+    CONSTANT,
+    VARIABLE,
+    NEG,
+    SIN,
+    COS,
+    SQRT,
+    EXP,
+    LOG,
+    ASIN,
+    ACOS,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    ATAN2,
+    POW,
+};
+
+/**
+ * structural identity of a node. two nodes are merged iff their kind, their
+ * (alias resolved) children and their payload are equal, so lookup cost does
+ * not depend on the size of the subtree.
+ */
+struct NodeKey {
+    OpCode op;
+    std::vector<int> args;
+    uint64_t payload;  // bit pattern of a constant
+    std::string name;  // name of a variable
+
+    bool operator==(const NodeKey &rhs) const {
+        return op == rhs.op and args == rhs.args and payload == rhs.payload and name == rhs.name;
+    }
+};
+
+struct NodeKeyHash {
+    size_t operator()(const NodeKey &key) const {
+        size_t h = std::hash<int>()(static_cast<int>(key.op));
+        auto combine = [&h](size_t v) { h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2); };
+        for (auto &&a : key.args) {
+            combine(std::hash<int>()(a));
+        }
+        combine(std::hash<uint64_t>()(key.payload));
+        if (key.name.size()) {
+            combine(std::hash<std::string>()(key.name));
+        }
+        return h;
+    }
+};
+
+inline uint64_t to_bits(double v) {
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+inline double from_bits(uint64_t bits) {
+    double v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// 64 bit FNV-1a, stable across runs and platforms of the same byte order
+template<class T>
+inline uint64_t fnv1a(const T &v, uint64_t h = 0xcbf29ce484222325ULL) {
+    static_assert(std::is_trivially_copyable<T>::value, "hash the bytes of trivially copyable values only");
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(&v);
+    for (size_t i = 0; i < sizeof(T); i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+inline uint64_t fnv1a(const std::string &s, uint64_t h = 0xcbf29ce484222325ULL) {
+    h = fnv1a(s.size(), h);
+    for (unsigned char c : s) {
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * bump allocator for node objects. objects are never moved, and the memory
+ * is released at once when the arena is destroyed.
+ */
+class NodeArena {
+ public:
+    NodeArena() {}
+    NodeArena(const NodeArena &) = delete;
+    NodeArena &operator=(const NodeArena &) = delete;
+    NodeArena(NodeArena &&) = default;
+    NodeArena &operator=(NodeArena &&) = default;
+
+    void *allocate(size_t size, size_t align) {
+        size_t offset = (used + align - 1) & ~(align - 1);
+        if (blocks.empty() or offset + size > capacity) {
+            capacity = std::max(block_size, size);
+            blocks.emplace_back(new char[capacity]);
+            offset = 0;
+        }
+        used = offset + size;
+        return blocks.back().get() + offset;
+    }
+
+ private:
+    static constexpr size_t block_size = 1 << 16;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t used{0}, capacity{0};
+};
+
+/**
+ * children of every node. the children of a node are stored contiguously and
+ * never move, appending has to be serialized by the caller.
+ */
+class ChildTable {
+ public:
+    struct Range {
+        const int *first, *last;
+        const int *begin() const { return first; }
+        const int *end() const { return last; }
+        size_t size() const { return last - first; }
+        int operator[](size_t i) const { return first[i]; }
+    };
+
+    void push_back(const std::vector<int> &children) {
+        int *first = static_cast<int*>(storage.allocate(sizeof(int) * children.size(), alignof(int)));
+        std::copy(children.begin(), children.end(), first);
+        ranges.push_back(Range{first, first + children.size()});
+    }
+
+    Range operator[](int id) const { return ranges[id]; }
+    size_t size() const { return ranges.size(); }
+
+    void clear() {
+        ranges.clear();
+        storage = NodeArena();
+    }
+
+ private:
+    NodeArena storage;
+    SegmentedVector<Range> ranges;
+};
+
+/**
+ * set of input variables, stored as a bitset over variable indices
+ */
+class VariableSet {
+ public:
+    void insert(int index) {
+        size_t w = index / 64;
+        if (w >= words.size()) {
+            words.resize(w + 1, 0);
+        }
+        words[w] |= uint64_t(1) << (index % 64);
+    }
+
+    bool contains(int index) const {
+        size_t w = index / 64;
+        return w < words.size() and ((words[w] >> (index % 64)) & 1);
+    }
+
+    void merge(const VariableSet &rhs) {
+        if (rhs.words.size() > words.size()) {
+            words.resize(rhs.words.size(), 0);
+        }
+        for (size_t i = 0; i < rhs.words.size(); i++) {
+            words[i] |= rhs.words[i];
+        }
+    }
+
+    bool intersects(const VariableSet &rhs) const {
+        size_t n = std::min(words.size(), rhs.words.size());
+        for (size_t i = 0; i < n; i++) {
+            if (words[i] & rhs.words[i]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool empty() const {
+        return std::none_of(words.begin(), words.end(), [](uint64_t w) { return w != 0; });
+    }
+
+ private:
+    std::vector<uint64_t> words;
+};
+
+/**
+ * owns the node table. the static interface works on the current factory of
+ * the calling thread, which is the most recently constructed one unless a
+ * Scope selects another, so independent factories can be used concurrently
+ * from different threads.
+ */
 class FactoryBase {
  public:
+    /**
+     * makes factory the current one of this thread while the scope is alive
+     */
+    class Scope {
+     public:
+        explicit Scope(const FactoryBase &factory) : previous(current()) {
+            current() = const_cast<FactoryBase*>(&factory);
+        }
+        ~Scope() { current() = previous; }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+     private:
+        FactoryBase *previous;
+    };
+
     static FactoryBase *get() {
-        return get_set(nullptr);
-    }
-    static int add(const Repr &repr, const std::unordered_set<int> &depends, std::shared_ptr<Function> f) {
-        return get()->_add(repr, depends, f);
+        return current();
     }
-    
-    static std::unordered_set<int> depends(int id) {
-        std::unordered_set<int> result = get()->_depends(id);
-        result.insert(id);
-        return result;
+
+    // returns the id of the node equal to f, registering a copy of f if there is none
+    template<class T>
+    static int insert(const T &f, bool &inserted) {
+        return get()->_insert(f, inserted);
     }
-    static std::unordered_set<int> depends(int id0, int id1) {
-        std::unordered_set<int> result = get()->_depends(id0);
-        for (auto &&i : get()->_depends(id1)) {
-            result.insert(i);
+
+    static Function *function(int id) { return get()->functions[id]; }
+    static ChildTable::Range children(int id) { return get()->child_table[get()->resolve(id)]; }
+    static double value(int id) { return get()->values[get()->resolve(id)]; }
+    static void setValue(int id, double v) { get()->values[get()->resolve(id)] = v; }
+
+    // input variables id transitively depends on
+    static const VariableSet &variableDepends(int id) { return get()->_variableDepends(id); }
+    // index of variable id, -1 if id is not a variable
+    static int variableIndex(int id) { return get()->_variableIndex(id); }
+    static bool checkDepends(int my_id, int var_id) {
+        int index = variableIndex(var_id);
+        if (index < 0) {
+            // not a variable, cannot be excluded
+            return true;
         }
-        result.insert(id0);
-        result.insert(id1);
-        return result;
+        return variableDepends(my_id).contains(index);
     }
-    static const std::unordered_set<int> &wholeDepends(int id) { return get()->_wholeDepends(id); }
-    static bool checkDepends(int my_id, int var_id) { auto &wdl = wholeDepends(my_id); return wdl.find(var_id) != wdl.end(); }
     static std::string repr(int id) {
-        return get()->rev_repr_map[id](get()->rev_repr_map);
+        std::lock_guard<std::mutex> lock(get()->repr_mutex);
+        return get()->renderer(id);
     }
 
+    // subexpressions longer than limit characters are printed as "...#<id>", 0 means unlimited
+    static void setReprLimit(size_t limit) {
+        std::lock_guard<std::mutex> lock(get()->repr_mutex);
+        get()->renderer.setLimit(limit);
+    }
+
+    // memoized derivative of id with respect to variable var_id, -1 if not known yet
+    static int cachedDiff(int id, int var_id) { return get()->_cachedDiff(id, var_id); }
+    static void cacheDiff(int id, int var_id, int result) { get()->_cacheDiff(id, var_id, result); }
+    // memoized partial derivative of id with respect to its index-th child, -1 if not known yet
+    static int cachedPartial(int id, int index) { return get()->_cachedDiff(id, partialKey(index)); }
+    static void cachePartial(int id, int index, int result) { get()->_cacheDiff(id, partialKey(index), result); }
+
+    // if set, Function::diff applies the chain rule through the memoized partials instead of the rule of each function
+    static bool diffThroughPartials() { return get()->diff_through_partials or diffState().through_partials; }
+    static void setDiffThroughPartials(bool enable) { get()->diff_through_partials = enable; }
+    // the same for the derivatives built by the calling thread only, returns the previous setting
+    static bool setThreadDiffThroughPartials(bool enable) {
+        return std::exchange(diffState().through_partials, enable);
+    }
+    // Function::diff stops with an exception once the calling thread has inserted more than num_nodes nodes from now on, 0 disables
+    static void setDiffNodeLimit(size_t num_nodes) {
+        diffState().max_inserted = num_nodes ? insertedNodes() + num_nodes : 0;
+    }
+    static bool diffOverNodeLimit() {
+        size_t limit = diffState().max_inserted;
+        return limit and insertedNodes() > limit;
+    }
+    // number of nodes the calling thread has inserted so far
+    static size_t insertedNodes() { return diffState().inserted; }
+
     static void setAliasRepr(int id0, int id1) {
-        if (id0 == id1) {
-            return;
-        }
-        get()->aliases[id0] = id1;
-        get()->rev_repr_map[id0] = get()->rev_repr_map[id1];
-        get()->depends_list[id0] = get()->depends_list[id1];
-        get()->whole_depends_list[id0] = get()->whole_depends_list[id1];
+        get()->_setAlias(id0, id1);
     }
 
     static int alias(int id) {
-        return get()->aliases[id] < 0 ? id : get()->aliases[id] ;
+        return get()->resolve(id);
+    }
+
+    static OpCode opcode(int id) {
+        return get()->opcodes[get()->resolve(id)];
     }
 
     template<class T>
     static bool is(int id) {
-        while (get()->aliases[id] >= 0) {
-            id = get()->aliases[id];
-        }
-        return dynamic_cast<T*>(get()->functions[id].get());
+        return opcode(id) == T::opcode;
     }
 
     template<class T>
-    static std::shared_ptr<T> ptr(int id) {
-        while (get()->aliases[id] >= 0) {
-            id = get()->aliases[id];
-        }
-        return std::dynamic_pointer_cast<T>(get()->functions[id]);
+    static T *ptr(int id) {
+        int r = get()->resolve(id);
+        return get()->opcodes[r] == T::opcode ? static_cast<T*>(get()->functions[r]) : nullptr;
     }
 
  protected:
-    static FactoryBase *get_set(FactoryBase *current) {
-        static FactoryBase *factory = nullptr;
-        if (current) {
-            factory = current;
-        }
+    static FactoryBase *&current() {
+        static thread_local FactoryBase *factory = nullptr;
         return factory;
     }
 
+    // what Function::diff of the calling thread is limited to, see Factory::budgetedDiff
+    struct DiffState {
+        size_t inserted{0};
+        size_t max_inserted{0};
+        bool through_partials{false};
+    };
+    static DiffState &diffState() {
+        static thread_local DiffState state;
+        return state;
+    }
+
  public:
-    virtual ~FactoryBase() {}
+    virtual ~FactoryBase();
+    size_t size() const { return functions.size(); }
     std::vector<int> idMapping() const {
-        std::vector<int> result(aliases.size());
-        for (size_t i = 0; i < aliases.size(); i++) {
-            int id = i;
-            while (aliases[id] >= 0) {
-                id = aliases[id];
-            }
-            result[i] = id;
+        std::vector<int> result(size());
+        for (size_t i = 0; i < result.size(); i++) {
+            result[i] = resolve(i);
         }
         return result;
     }
-    const std::vector<Repr> &reprList() const { return rev_repr_map; }
+    std::vector<Repr> reprList() const {
+        std::lock_guard<std::mutex> lock(repr_mutex);
+        std::vector<Repr> result(size());
+        for (size_t i = 0; i < result.size(); i++) {
+            result[i] = rev_repr_map[i];
+        }
+        return result;
+    }
+    const ChildTable &childTable() const { return child_table; }
     
  protected:
     FactoryBase() : num_input_variables(0) {
-        get_set(this);
-    }
-
-    int _add(const Repr &repr_obj, const std::unordered_set<int> &depends, std::shared_ptr<Function> f) {
-        std::string repr = repr_obj(rev_repr_map);
-        // std::cout << repr << " : ";
-        // for (auto &&d : depends) {
-        //     std::cout << FactoryBase::repr(d) << ", ";
-        // }
-        // std::cout << std::endl;
-        auto iter = repr_map.find(repr);
-        if (iter == repr_map.end()) {
-            int index = repr_map.size();
-            repr_map[repr] = index;
-            rev_repr_map.push_back(repr_obj);
-            org_rev_repr_map.push_back(repr_obj);
-            depends_list.push_back(depends);
-            whole_depends_list.push_back(depends);
-            for (auto &&d: depends) {
-                for (auto &&j : whole_depends_list[d]) {
-                    whole_depends_list[index].insert(j);
-                }
-            }
-            aliases.push_back(-1);
-            functions.push_back(f);
-            return index;
+        epoch_handles.push_back(0);
+        current() = this;
+    }
+
+    // defined in function.hpp, where Function is complete
+    template<class T>
+    int _insert(const T &f, bool &inserted);
+
+    // removes every node not reachable from roots or from a live Symbol and
+    // renumbers the rest, returns the number of removed nodes. defined in
+    // function.hpp, must not run concurrently with anything else on this factory
+    size_t _collect(const std::vector<int> &roots);
+
+    using Relocator = Function *(*)(const Function *, NodeArena &);
+
+    template<class T>
+    static Function *relocate(const Function *f, NodeArena &arena) {
+        return new (arena.allocate(sizeof(T), alignof(T))) T(*static_cast<const T*>(f));
+    }
+
+    // Symbol handles are counted per node, so that collection can find the
+    // nodes they keep alive. handles created before a collection still carry
+    // their old id, which is translated through the forwarding table of
+    // their epoch. they are counted per epoch as well, the table of an
+    // epoch without handles is released.
+    void retain(int id) {
+        refcounts[id].fetch_add(1, std::memory_order_relaxed);
+        epoch_handles[epoch()].fetch_add(1, std::memory_order_relaxed);
+    }
+    void release(int id, uint32_t epoch_) {
+        refcounts[id].fetch_sub(1, std::memory_order_relaxed);
+        epoch_handles[epoch_].fetch_sub(1, std::memory_order_relaxed);
+    }
+    uint32_t epoch() const { return forwarding.size(); }
+    int forward(int id, uint32_t epoch_) const { return forwarding[epoch_][id]; }
+
+    // appends a node to the table, table_mutex must be held
+    int _add(const NodeKey &key, const Repr &repr_obj, Function *f, Relocator relocator) {
+        int index = functions.size();
+        rev_repr_map.push_back(repr_obj);
+        opcodes.push_back(key.op);
+        values.push_back(key.op == OpCode::CONSTANT ? from_bits(key.payload) : 0.0);
+        child_table.push_back(key.args);
+        variable_indices.push_back(-1);
+        VariableSet depends;
+        if (key.op == OpCode::VARIABLE) {
+            variable_indices[index] = num_input_variables++;
+            depends.insert(variable_indices[index]);
+        }
+        for (auto &&d : key.args) {
+            depends.merge(variable_depends[d]);
         }
-        return iter->second;
+        variable_depends.push_back(std::move(depends));
+        parents.push_back(index);
+        ranks.push_back(0);
+        representatives.push_back(index);
+        functions.push_back(f);
+        relocators.push_back(relocator);
+        refcounts.push_back(0);
+        return index;
     }
 
-    const std::unordered_set<int> &_depends(int id) const { return depends_list[id]; }
-    const std::unordered_set<int> &_wholeDepends(int id) const { return whole_depends_list[id]; }
+    int _cachedDiff(int id, int var_id) {
+        uint64_t key = diffKey(id, var_id);
+        DiffShard &shard = diff_cache[((key * 0x9e3779b97f4a7c15ULL) >> 32) % num_shards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.map.find(key);
+        return found == shard.map.end() ? -1 : found->second;
+    }
+
+    void _cacheDiff(int id, int var_id, int result) {
+        uint64_t key = diffKey(id, var_id);
+        DiffShard &shard = diff_cache[((key * 0x9e3779b97f4a7c15ULL) >> 32) % num_shards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.map[key] = result;
+    }
+
+    uint64_t diffKey(int id, int var_id) const {
+        return (uint64_t(resolve(id)) << 32) | uint32_t(var_id < 0 ? var_id : resolve(var_id));
+    }
+
+    // ids are never negative, so a partial can not collide with a derivative by a variable
+    static int partialKey(int index) { return -1 - index; }
+
+    const VariableSet &_variableDepends(int id) const { return variable_depends[resolve(id)]; }
+    int _variableIndex(int id) const { return variable_indices[resolve(id)]; }
+
+    void _setAlias(int id0, int id1) {
+        std::lock_guard<std::mutex> lock(alias_mutex);
+        int rep0 = resolve(id0), rep1 = resolve(id1);
+        if (rep0 == rep1) {
+            return;
+        }
+        unite(rep0, rep1);
+        std::lock_guard<std::mutex> repr_lock(repr_mutex);
+        rev_repr_map[rep0] = _repr(rep1);
+        renderer.invalidate();
+    }
+
+    // the most simplified node equal to id
+    int resolve(int id) const {
+        return representatives[find(id)].load(std::memory_order_acquire);
+    }
+
+    // aliases form a union-find with path compression and union by rank,
+    // the representative of a set is tracked separately from its root.
+    // find only ever redirects non-root nodes to an ancestor, so it can run
+    // concurrently with unite.
+    int find(int id) const {
+        int root = id;
+        for (int p; (p = parents[root].load(std::memory_order_acquire)) != root;) {
+            root = p;
+        }
+        while (id != root) {
+            int next = parents[id].load(std::memory_order_relaxed);
+            parents[id].store(root, std::memory_order_relaxed);
+            id = next;
+        }
+        return root;
+    }
+
+    // makes every node equal to id0 an alias of id1, alias_mutex must be held
+    void unite(int id0, int id1) {
+        int r0 = find(id0), r1 = find(id1);
+        if (r0 == r1) {
+            return;
+        }
+        int representative = representatives[r1].load(std::memory_order_relaxed);
+        if (ranks[r0] > ranks[r1]) {
+            std::swap(r0, r1);
+        }
+        if (ranks[r0] == ranks[r1]) {
+            ranks[r1]++;
+        }
+        representatives[r1].store(representative, std::memory_order_release);
+        parents[r0].store(r1, std::memory_order_release);
+    }
 
  protected:
+    // hash-consing map, sharded so that threads creating different nodes rarely contend
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<NodeKey, int, NodeKeyHash> map;
+    };
+    static constexpr size_t num_shards = 64;
+    std::array<Shard, num_shards> shards;
+
+    // derivatives already built, keyed by (node, variable)
+    struct DiffShard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, int> map;
+    };
+    std::array<DiffShard, num_shards> diff_cache;
+    std::atomic<bool> diff_through_partials{false};
+    std::mutex table_mutex, alias_mutex;
+    mutable std::mutex repr_mutex;
+
     int num_input_variables;
-    std::unordered_map<std::string, int> repr_map;
-    std::vector<Repr> rev_repr_map, org_rev_repr_map;
-    std::vector<std::unordered_set<int>> depends_list, whole_depends_list;
-    std::vector<int> aliases;
-    std::vector<std::shared_ptr<Function>> functions;
+    SegmentedVector<Repr> rev_repr_map;
+    ReprRenderer<SegmentedVector<Repr>> renderer{rev_repr_map};
+
+    // node table, indexed by node id
+    SegmentedVector<OpCode> opcodes;
+    SegmentedVector<double> values;
+    ChildTable child_table;
+    SegmentedVector<int> variable_indices;
+    SegmentedVector<VariableSet> variable_depends;
+    mutable SegmentedVector<std::atomic<int>> parents;
+    SegmentedVector<uint8_t> ranks;
+    SegmentedVector<std::atomic<int>> representatives;
+    SegmentedVector<Function*> functions;
+    SegmentedVector<Relocator> relocators;
+    SegmentedVector<std::atomic<int>> refcounts;
+    NodeArena arena;
+
+    // forwarding[e] maps the ids of epoch e to the current ids, -1 if removed.
+    // it is empty once no handle of epoch e is left
+    std::vector<std::vector<int>> forwarding;
+    SegmentedVector<std::atomic<long>> epoch_handles;  // live handles per epoch
+
+ private:
+    friend class Function;
 };
 }  // namespace sym
 
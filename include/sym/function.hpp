@@ -9,28 +9,62 @@
 #define FUNCTION_HPP_
 
 #include <map>
+#include <new>
+#include <cmath>
+#include <limits>
+#include <charconv>
 #include "factory_base.hpp"
 
 namespace sym {
 
-class Function : public std::enable_shared_from_this<Function> {
+class Function {
  public:
-    // using shared = std::shared_ptr<Function>;
-    
-    class Symbol : public std::shared_ptr<Function> {
+    /**
+     * handle to a node of the current factory. it is the node id plus the
+     * epoch it was taken in, the node itself is owned by the factory, which
+     * counts live handles so that collection keeps their nodes.
+     */
+    class Symbol {
      public:
-        Symbol(){}
-        Symbol(const std::shared_ptr<Function> &f) : std::shared_ptr<Function>(f) {}
-        Symbol(double v); //  : std::shared_ptr<Function>(_make_shared<Constant>(v)) {}
+        Symbol() : _id(-1), _epoch(0), _factory(nullptr) {}
+        Symbol(double v);
+        Symbol(const Symbol &rhs) : Symbol() { attach(rhs._factory, rhs.index()); }
+        Symbol(Symbol &&rhs) : _id(rhs._id), _epoch(rhs._epoch), _factory(rhs._factory) {
+            rhs._id = -1;
+            rhs._factory = nullptr;
+        }
+        ~Symbol() { detach(); }
+
+        Symbol &operator = (const Symbol &rhs) {
+            if (this != &rhs) {
+                Symbol s(rhs);
+                std::swap(_id, s._id);
+                std::swap(_epoch, s._epoch);
+                std::swap(_factory, s._factory);
+            }
+            return *this;
+        }
 
-        Symbol & operator = (const double &v);
-        template<class T>
-        typename std::enable_if<std::is_base_of<Function, typename T::element_type>::value, Symbol &>::type
-        operator=(const T &v) {
-            std::shared_ptr<Function>::operator=(std::dynamic_pointer_cast<Function>(v));
+        Symbol &operator = (Symbol &&rhs) {
+            if (this != &rhs) {
+                detach();
+                _id = rhs._id;
+                _epoch = rhs._epoch;
+                _factory = rhs._factory;
+                rhs._id = -1;
+                rhs._factory = nullptr;
+            }
             return *this;
         }
 
+        static Symbol fromId(int id) {
+            Symbol s;
+            s.attach(FactoryBase::get(), id);
+            return s;
+        }
+
+        Symbol & operator = (const double &v);
+
         Symbol & operator += (const double &v);
         Symbol & operator -= (const double &v);
         Symbol & operator += (const Symbol &v);
@@ -52,10 +86,42 @@ class Function : public std::enable_shared_from_this<Function> {
             return get()->id() < rhs->id();
         }
 
+        Function *get() const { return FactoryBase::function(index()); }
+        Function *operator->() const { return get(); }
+        Function &operator*() const { return *get(); }
+        explicit operator bool() const { return _id >= 0; }
+
         std::string repr() const { return get()->repr(); }
         double eval() const { return get()->eval(); }
         Symbol diff(Symbol v) const { return get()->diff(v); }
         Symbol subs(const std::map<Symbol, Symbol> &m) const { return get()->subs(m); }
+
+     private:
+        // id in the current numbering of the factory
+        int index() const {
+            return (not _factory or _epoch == _factory->epoch()) ? _id : _factory->forward(_id, _epoch);
+        }
+
+        void attach(FactoryBase *factory, int id) {
+            _id = id;
+            _factory = id >= 0 ? factory : nullptr;
+            if (_factory) {
+                _epoch = _factory->epoch();
+                _factory->retain(_id);
+            }
+        }
+
+        void detach() {
+            if (_factory) {
+                _factory->release(index(), _epoch);
+                _factory = nullptr;
+            }
+        }
+
+     private:
+        int _id;
+        uint32_t _epoch;
+        FactoryBase *_factory;
     };
     
  public:
@@ -63,11 +129,16 @@ class Function : public std::enable_shared_from_this<Function> {
     int id() const { return FactoryBase::alias(_id); }
     int orgId() const { return _id; }
     std::string repr() const { return FactoryBase::repr(_id); }
+    Symbol self() const { return Symbol::fromId(_id); }
 
     virtual Symbol diff(Symbol v) const final;
     virtual void simplified() const = 0;
     virtual double eval() const = 0;
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const = 0;
+    // derivative with respect to the index-th child, in the order of FactoryBase::children
+    virtual Symbol partial(int index) const = 0;
+    // partial, built once per node
+    Symbol localPartial(int index) const;
 
     template <class T>
     bool is() const {
@@ -75,75 +146,288 @@ class Function : public std::enable_shared_from_this<Function> {
     }
 
     template <class T>
-    std::shared_ptr<T> ptr() const {
+    T *ptr() const {
         return FactoryBase::ptr<T>(id());
     }
 
  protected:
     virtual Symbol _diff(Symbol v) const = 0;
-    Function(const Repr &repr_, const std::unordered_set<int> &depends_) : _mem_repr(repr_), _mem_depends(depends_), _id(-1) {}
+    Symbol _diffThroughPartials(Symbol v) const;  // defined in function_impl.hpp
+    Function(OpCode op_) : _op(op_), _id(-1) {}
+
+    // structural identity and printed form, only used when the node is registered
+    virtual NodeKey key() const = 0;
+    virtual Repr reprTemplate() const = 0;
 
  private:
-    void initId() {
-        _id = FactoryBase::add(_mem_repr, _mem_depends, shared_from_this());
-    }
-    template<class T, class ...Args> friend std::shared_ptr<T> _make_shared(Args... args);
+    friend class FactoryBase;
+
+ protected:
+    OpCode _op;
 
  private:
-    Repr _mem_repr;
-    std::unordered_set<int> _mem_depends;
     int _id;
 };
 
-template<class T, class ...Args>
-std::shared_ptr<T> _make_shared(Args... args) {
-    std::shared_ptr<T> r = std::make_shared<T>(args...);
-    r->initId();
-    r->simplified();
-    return r;
-}
-
 using Symbol = Function::Symbol;
 
+/**
+ * returns the node T(args...), creating and simplifying it only if no
+ * structurally equal node exists yet.
+ */
 template<class T, class ...Args>
 Symbol make_symbol(Args... args) {
-    Symbol r;
-    r = _make_shared<T>(args...);
-    return r;
+    bool inserted;
+    Symbol s = Symbol::fromId(FactoryBase::insert(T(args...), inserted));
+    if (inserted) {
+        s->simplified();
+    }
+    return s;
+}
+
+template<class T>
+int FactoryBase::_insert(const T &f, bool &inserted) {
+    NodeKey key = static_cast<const Function &>(f).key();
+    for (auto &&a : key.args) {
+        a = resolve(a);
+    }
+    Shard &shard = shards[NodeKeyHash()(key) % num_shards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.map.find(key);
+    if (found != shard.map.end()) {
+        inserted = false;
+        return found->second;
+    }
+    int id;
+    {
+        std::lock_guard<std::mutex> table_lock(table_mutex);
+        T *p = new (arena.allocate(sizeof(T), alignof(T))) T(f);
+        id = p->_id = functions.size();
+        _add(key, static_cast<const Function *>(p)->reprTemplate(), p, &relocate<T>);
+    }
+    shard.map.emplace(std::move(key), id);
+    diffState().inserted++;
+    inserted = true;
+    return id;
+}
+
+inline size_t FactoryBase::_collect(const std::vector<int> &roots) {
+    Scope scope(*this);
+    size_t n = size();
+
+    // handles held by nodes are not roots, what remains are the live Symbols
+    std::vector<long> external(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        external[resolve(i)] += refcounts[i].load(std::memory_order_relaxed);
+        for (auto &&c : child_table[i]) {
+            external[resolve(c)]--;
+        }
+    }
+    std::vector<int> stack(roots.size());
+    std::transform(roots.begin(), roots.end(), stack.begin(), [this](int id) { return resolve(id); });
+    for (size_t i = 0; i < n; i++) {
+        if (external[i] > 0) {
+            stack.push_back(i);
+        }
+    }
+    std::vector<bool> marked(n, false);
+    while (stack.size()) {
+        int id = stack.back();
+        stack.pop_back();
+        if (marked[id]) {
+            continue;
+        }
+        marked[id] = true;
+        for (auto &&c : child_table[id]) {
+            stack.push_back(resolve(c));
+        }
+    }
+
+    // live nodes keep their relative order
+    std::vector<int> renumber(n, -1), live;
+    for (size_t i = 0; i < n; i++) {
+        if (marked[i]) {
+            renumber[i] = live.size();
+            live.push_back(i);
+        }
+    }
+    if (live.size() == n) {
+        return 0;
+    }
+    std::vector<int> fwd(n);
+    for (size_t i = 0; i < n; i++) {
+        fwd[i] = renumber[resolve(i)];
+    }
+
+    // move the live nodes to a fresh arena, destroying the old objects drops
+    // the handles held by dead nodes
+    NodeArena new_arena;
+    std::vector<Function*> new_functions(live.size());
+    for (size_t i = 0; i < live.size(); i++) {
+        new_functions[i] = relocators[live[i]](functions[live[i]], new_arena);
+        new_functions[i]->_id = i;
+    }
+    for (size_t i = 0; i < n; i++) {
+        functions[i]->~Function();
+    }
+
+    std::vector<int> new_refcounts(live.size(), 0);
+    for (size_t i = 0; i < n; i++) {
+        if (fwd[i] >= 0) {
+            new_refcounts[fwd[i]] += refcounts[i].load(std::memory_order_relaxed);
+        }
+    }
+    std::vector<Repr> new_reprs(live.size());
+    std::vector<std::vector<int>> new_children(live.size());
+    std::vector<OpCode> new_opcodes(live.size());
+    std::vector<double> new_values(live.size());
+    std::vector<int> new_variable_indices(live.size());
+    std::vector<VariableSet> new_variable_depends(live.size());
+    std::vector<Relocator> new_relocators(live.size());
+    for (size_t i = 0; i < live.size(); i++) {
+        int id = live[i];
+        new_reprs[i] = rev_repr_map[id];
+        for (auto &&item : new_reprs[i].items) {
+            if (item.is_id) {
+                item.id = fwd[item.id];
+            }
+        }
+        for (auto &&c : child_table[id]) {
+            new_children[i].push_back(fwd[c]);
+        }
+        new_opcodes[i] = opcodes[id];
+        new_values[i] = values[id];
+        new_variable_indices[i] = variable_indices[id];
+        new_variable_depends[i] = variable_depends[id];
+        new_relocators[i] = relocators[id];
+    }
+
+    for (auto &&shard : shards) {
+        shard.map.clear();
+    }
+    for (auto &&shard : diff_cache) {
+        shard.map.clear();
+    }
+    rev_repr_map.clear();
+    opcodes.clear();
+    values.clear();
+    child_table.clear();
+    variable_indices.clear();
+    variable_depends.clear();
+    parents.clear();
+    ranks.clear();
+    representatives.clear();
+    functions.clear();
+    relocators.clear();
+    refcounts.clear();
+    arena = std::move(new_arena);
+    for (size_t i = 0; i < live.size(); i++) {
+        rev_repr_map.push_back(std::move(new_reprs[i]));
+        opcodes.push_back(new_opcodes[i]);
+        values.push_back(new_values[i]);
+        child_table.push_back(new_children[i]);
+        variable_indices.push_back(new_variable_indices[i]);
+        variable_depends.push_back(std::move(new_variable_depends[i]));
+        parents.push_back(i);
+        ranks.push_back(0);
+        representatives.push_back(i);
+        functions.push_back(new_functions[i]);
+        relocators.push_back(new_relocators[i]);
+        refcounts.push_back(new_refcounts[i]);
+    }
+
+    // handles of every earlier epoch now translate directly to the new ids,
+    // the tables of epochs without handles are dropped, so their number
+    // does not grow with the number of collections
+    for (size_t e = 0; e < forwarding.size(); e++) {
+        if (epoch_handles[e].load(std::memory_order_relaxed) == 0) {
+            std::vector<int>().swap(forwarding[e]);
+        }
+        for (auto &&id : forwarding[e]) {
+            id = id >= 0 ? fwd[id] : -1;
+        }
+    }
+    if (epoch_handles[epoch()].load(std::memory_order_relaxed) == 0) {
+        fwd.clear();
+    }
+    forwarding.push_back(std::move(fwd));
+    epoch_handles.push_back(0);
+
+    for (size_t i = 0; i < live.size(); i++) {
+        NodeKey key = static_cast<const Function *>(functions[i])->key();
+        shards[NodeKeyHash()(key) % num_shards].map.emplace(std::move(key), i);
+    }
+    renderer.invalidate();
+    return n - live.size();
+}
+
+inline FactoryBase::~FactoryBase() {
+    if (current() == this) {
+        current() = nullptr;
+    }
+    for (size_t i = 0; i < functions.size(); i++) {
+        functions[i]->~Function();
+    }
+}
+
+/**
+ * shortest C++ literal that reads back as exactly v
+ */
+inline std::string to_literal(double v) {
+    if (std::isnan(v)) {
+        return "std::numeric_limits<double>::quiet_NaN()";
+    } else if (std::isinf(v)) {
+        return v > 0 ? "std::numeric_limits<double>::infinity()" : "(-std::numeric_limits<double>::infinity())";
+    }
+    char buf[32];
+    auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), v);
+    std::string s(buf, end);
+    if (s.find_first_of(".e") == std::string::npos) {
+        // keep it a floating point literal, "1/2" would be an integer division
+        s += ".0";
+    }
+    return v < 0 ? "(" + s + ")" : s;
 }
 
 class Constant : public Function {
  public:
-    Constant(double value_) : Function(_repr(std::to_string(value_)), {}), _value(value_) {}
+    static constexpr OpCode opcode = OpCode::CONSTANT;
+
+    // -0.0 is folded into 0.0, every other value is kept bit-exact
+    Constant(double value_) : Function(opcode), _value(value_ == 0 ? 0.0 : value_) {}
     virtual void simplified() const override {}
-    virtual double eval() const override { return _value; }
-    virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return Symbol(ptr<Function>()); }
+    virtual double eval() const override { return FactoryBase::value(id()); }
+    virtual Symbol subs(const std::map<Symbol, Symbol> &) const override { return self(); }
+    virtual Symbol partial(int) const override { throw std::runtime_error("constant has no children"); }
 
 
  protected:
-    virtual Symbol _diff(Symbol v) const override { return make_symbol<Constant>(0); }
+    virtual Symbol _diff(Symbol) const override { return make_symbol<Constant>(0); }
+    virtual NodeKey key() const override { return {_op, {}, to_bits(_value), ""}; }
+    virtual Repr reprTemplate() const override { return _repr(to_literal(_value)); }
 
  protected:
     double _value;
 };
 
+inline bool is_constant(const Symbol &f) {
+    return FactoryBase::is<Constant>(f->id());
+}
+
+inline bool is_constant(const Symbol &f, double v) {
+    return is_constant(f) and FactoryBase::value(f->id()) == v;
+}
+
 inline bool is_zero(const Symbol &f) {
-    static const std::string zero_string = std::to_string(0.0);
-    return f->repr() == zero_string;
+    return is_constant(f, 0);
 }
 
 inline bool is_one(const Symbol &f) {
-    static const std::string one_string = std::to_string(1.0);
-    return f->repr() == one_string;
+    return is_constant(f, 1);
 }
 
 inline bool is_negative_one(const Symbol &f) {
-    static const std::string negative_one_string = std::to_string(-1.0);
-    return f->repr() == negative_one_string;
-}
-
-inline bool is_constant(const Symbol &f) {
-    return FactoryBase::is<Constant>(f->id());
+    return is_constant(f, -1);
 }
 
 inline Symbol zero() {
@@ -160,27 +444,32 @@ inline Symbol negative_one() {
 
 class Variable : public Function {
  public:
-    Variable(const std::string &symbol) : Function(_repr(symbol), {}) {}
+    static constexpr OpCode opcode = OpCode::VARIABLE;
+
+    Variable(const std::string &symbol_) : Function(opcode), symbol(symbol_) {}
     virtual void simplified() const override {}
-    virtual double eval() const override { return _value; }
+    virtual double eval() const override { return FactoryBase::value(id()); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override {
-        Symbol self(ptr<Variable>());
-        auto iter = m.find(self);
+        Symbol s = self();
+        auto iter = m.find(s);
         if (iter != m.end()) {
             return iter->second;
         }
-        return self;
+        return s;
     }
-    void assign(double v) { _value = v; }
+    virtual Symbol partial(int) const override { throw std::runtime_error("variable has no children"); }
+    void assign(double v) { FactoryBase::setValue(id(), v); }
 
  protected:
     virtual Symbol _diff(Symbol v) const override {
         if (v->id() == id()) { return make_symbol<Constant>(1); }
         return make_symbol<Constant>(0);
     }
+    virtual NodeKey key() const override { return {_op, {}, 0, symbol}; }
+    virtual Repr reprTemplate() const override { return _repr(symbol); }
 
  protected:
-    double _value{0};
+    std::string symbol;
 };
 
 inline Function::Symbol Function::diff(Symbol v) const {
@@ -189,12 +478,31 @@ inline Function::Symbol Function::diff(Symbol v) const {
     } else if (not FactoryBase::checkDepends(id(), v->id())) {
         return make_symbol<Constant>(0);
     }
-    auto result = _diff(v);
+    int cached = FactoryBase::cachedDiff(id(), v->id());
+    if (cached >= 0) {
+        return Symbol::fromId(cached);
+    }
+    if (FactoryBase::diffOverNodeLimit()) {
+        throw std::runtime_error("diff exceeded the node limit");
+    }
+    auto result = FactoryBase::diffThroughPartials() ? _diffThroughPartials(v) : _diff(v);
     result->simplified();
+    FactoryBase::cacheDiff(id(), v->id(), result->id());
+    return result;
+}
+
+inline Function::Symbol Function::localPartial(int index) const {
+    int cached = FactoryBase::cachedPartial(id(), index);
+    if (cached >= 0) {
+        return Symbol::fromId(cached);
+    }
+    // this may be aliased to a simpler node, whose children are the ones indexed
+    Symbol result = FactoryBase::function(id())->partial(index);
+    FactoryBase::cachePartial(id(), index, result->id());
     return result;
 }
 
-inline Function::Symbol::Symbol(double v) : std::shared_ptr<Function>(_make_shared<Constant>(v)) {}
+inline Function::Symbol::Symbol(double v) : Symbol(make_symbol<Constant>(v)) {}
 inline Function::Symbol & Function::Symbol::operator = (const double &v) { *this = Symbol(v); return *this; }
 
 inline std::ostream &operator<<(std::ostream &os, const Symbol &arg) {
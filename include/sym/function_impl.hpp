@@ -13,6 +13,19 @@
 
 namespace sym {
 
+// chain rule, sum of the child derivatives times the local partials
+inline Function::Symbol Function::_diffThroughPartials(Symbol v) const {
+    std::vector<Symbol> terms;
+    ChildTable::Range c = FactoryBase::children(id());
+    for (size_t k = 0; k < c.size(); k++) {
+        Symbol d = FactoryBase::function(FactoryBase::alias(c[k]))->diff(v);
+        if (not is_zero(d)) {
+            terms.push_back(make_symbol<MulFunction>(d, localPartial(k)));
+        }
+    }
+    return sum(terms);
+}
+
 inline Function::Symbol & Function::Symbol::operator += (const double &v) {
     return *this = (*this) + v;
 }
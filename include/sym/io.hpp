@@ -33,10 +33,10 @@ class Input : public Tagged {
     size_t size() const { return v.size(); }
     const Symbol *data() const { return v.data(); }
     Symbol operator ()(int index) const { return v[index]; }
+    Symbol operator [](int index) const { return v[index]; }
     void assign(const std::vector<double> &values) {
         for (size_t i = 0; i < values.size(); i++) {
-            auto vi = std::dynamic_pointer_cast<Variable>(v[i]);
-            vi->assign(values[i]);
+            v[i]->ptr<Variable>()->assign(values[i]);
         }
     }
     // Function::shared operator [](int index) const { return v[index]; }
@@ -56,11 +56,149 @@ class Output : public Tagged {
     const Symbol *data() const { return v.data(); }
     Symbol &operator ()(int index) { return v[index]; }
     const Symbol &operator ()(int index) const { return v[index]; }
+    Symbol &operator [](int index) { return v[index]; }
+    const Symbol &operator [](int index) const { return v[index]; }
+    // e.g. the result of Factory::jvp or vjp
+    void assign(const std::vector<Symbol> &values) {
+        if (values.size() != v.size()) {
+            throw std::runtime_error("output size mismatch");
+        }
+        std::copy(values.begin(), values.end(), v.begin());
+    }
 
  protected:
     std::vector<Symbol> v;
 };
 
+/**
+ * rows x cols matrix output of which only the structurally nonzero entries
+ * are computed. unset and zero entries are dropped, the generated code
+ * writes the others packed in row major order, and prints their pattern
+ * as static constexpr CSR/COO arrays named after the output.
+ * a compressed output writes a column colored compressed matrix instead,
+ * see compress.
+ */
+class SparseOutput : public Tagged {
+ public:
+    SparseOutput(IOTag tag_, const std::string &symbol_, int rows, int cols) : Tagged(tag_, symbol_) {
+        pattern.rows = rows;
+        pattern.cols = cols;
+        pattern.row_offsets.assign(rows + 1, 0);
+        Factory::addOutput(tag_, symbol, &values);
+        Factory::addSparsePattern(symbol, &pattern);
+    }
+
+    int rows() const { return pattern.rows; }
+    int cols() const { return pattern.cols; }
+    size_t nnz() const { return pattern.nnz(); }
+    const SparsePattern &sparsePattern() const { return pattern; }
+
+    Symbol operator ()(int row, int col) const {
+        int k = find(row, col);
+        if (k < 0) {
+            return zero();
+        }
+        return pattern.num_colors ? values[row * pattern.num_colors + pattern.colors[col]] : values[k];
+    }
+
+    void set(int row, int col, const Symbol &s) {
+        if (pattern.num_colors) {
+            throw std::runtime_error("entries of a compressed sparse output can not be set");
+        }
+        if (row < 0 or row >= pattern.rows or col < 0 or col >= pattern.cols) {
+            throw std::runtime_error("sparse output index out of range");
+        }
+        auto first = pattern.col_indices.begin() + pattern.row_offsets[row];
+        auto last = pattern.col_indices.begin() + pattern.row_offsets[row + 1];
+        auto iter = std::lower_bound(first, last, col);
+        size_t k = iter - pattern.col_indices.begin();
+        bool nonzero = s and not is_zero(s);
+        if (iter != last and *iter == col) {
+            if (nonzero) {
+                values[k] = s;
+                return;
+            }
+            pattern.col_indices.erase(iter);
+            values.erase(values.begin() + k);
+            shift(row, -1);
+        } else if (nonzero) {
+            pattern.col_indices.insert(iter, col);
+            values.insert(values.begin() + k, s);
+            shift(row, 1);
+        }
+    }
+
+    // e.g. the result of Factory::jacobian, whose structural zeros are known without differentiating
+    void assign(const std::vector<std::vector<Symbol>> &matrix) {
+        pattern.row_offsets.assign(1, 0);
+        pattern.col_indices.clear();
+        pattern.num_colors = 0;
+        pattern.colors.clear();
+        values.clear();
+        for (int r = 0; r < pattern.rows; r++) {
+            for (int c = 0; c < pattern.cols; c++) {
+                const Symbol &s = matrix.at(r).at(c);
+                if (s and not is_zero(s)) {
+                    pattern.col_indices.push_back(c);
+                    values.push_back(s);
+                }
+            }
+            pattern.row_offsets.push_back(pattern.col_indices.size());
+        }
+    }
+
+    /**
+     * outputs compressed, the result of Factory::compressedJacobian or
+     * compressedHessian for colors, and keeps structural_pattern. every
+     * row must have at most one nonzero of each color.
+     */
+    void compress(const SparsePattern &structural_pattern, const std::vector<int> &colors,
+                  const std::vector<std::vector<Symbol>> &compressed) {
+        if (structural_pattern.rows != pattern.rows or structural_pattern.cols != pattern.cols or
+            colors.size() != static_cast<size_t>(pattern.cols) or compressed.size() != static_cast<size_t>(pattern.rows)) {
+            throw std::runtime_error("compressed sparse output size mismatch");
+        }
+        int num_colors = colors.size() ? *std::max_element(colors.begin(), colors.end()) + 1 : 0;
+        for (int r = 0; r < pattern.rows; r++) {
+            std::vector<bool> used(num_colors, false);
+            for (int k = structural_pattern.row_offsets[r]; k < structural_pattern.row_offsets[r + 1]; k++) {
+                int color = colors[structural_pattern.col_indices[k]];
+                if (used[color]) {
+                    throw std::runtime_error("columns of the same color share row " + std::to_string(r));
+                }
+                used[color] = true;
+            }
+        }
+        pattern = structural_pattern;
+        pattern.num_colors = num_colors;
+        pattern.colors = colors;
+        values.clear();
+        for (auto &&row : compressed) {
+            for (int color = 0; color < num_colors; color++) {
+                const Symbol &s = row.at(color);
+                values.push_back(s ? s : zero());
+            }
+        }
+    }
+
+ protected:
+    int find(int row, int col) const {
+        auto first = pattern.col_indices.begin() + pattern.row_offsets[row];
+        auto last = pattern.col_indices.begin() + pattern.row_offsets[row + 1];
+        auto iter = std::lower_bound(first, last, col);
+        return (iter != last and *iter == col) ? iter - pattern.col_indices.begin() : -1;
+    }
+
+    void shift(int row, int d) {
+        for (int r = row + 1; r <= pattern.rows; r++) {
+            pattern.row_offsets[r] += d;
+        }
+    }
+
+ protected:
+    SparsePattern pattern;
+    std::vector<Symbol> values;
+};
 
 class StaticInput : public Input {
  public:
@@ -82,6 +220,16 @@ class DynamicOutput : public Output {
     DynamicOutput(const std::string &symbol_, int num_variables) : Output(IOTag::DYNAMIC, symbol_, num_variables) {}
 };
 
+class StaticSparseOutput : public SparseOutput {
+ public:
+    StaticSparseOutput(const std::string &symbol_, int rows, int cols) : SparseOutput(IOTag::STATIC, symbol_, rows, cols) {}
+};
+
+class DynamicSparseOutput : public SparseOutput {
+ public:
+    DynamicSparseOutput(const std::string &symbol_, int rows, int cols) : SparseOutput(IOTag::DYNAMIC, symbol_, rows, cols) {}
+};
+
 }  // namespace sym
 
 #endif  // IO_HPP_
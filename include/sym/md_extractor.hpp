@@ -8,103 +8,101 @@
 #ifndef MD_EXTRACTOR_HPP_
 #define MD_EXTRACTOR_HPP_
 
+#include <algorithm>
+#include <cmath>
+
 #include "function.hpp"
 #include "unary_function.hpp"
 #include "binary_function.hpp"
 
 namespace sym {
 
+/**
+ * collects the factors of a product with their exponents, a divisor has
+ * exponent -1 and b^c with a constant c exponent c. factors are sorted so
+ * that the exponents of a base are summed, which also cancels x / x, and
+ * the constants and signs are folded into one constant.
+ */
 class MDExtractor {
  public:
-    void addMul(Symbol s) {
-        if (s->is<MulFunction>()) {
-            std::shared_ptr<MulFunction> p = s->ptr<MulFunction>();
-            addMul(p->arg0);
-            addMul(p->arg1);
-        } else if (s->is<DivFunction>()) {
-            std::shared_ptr<DivFunction> p = s->ptr<DivFunction>();
-            addDiv(p->arg1);
-        } else if (s->is<NegFunction>()) {
-            is_negative = not is_negative;
-            std::shared_ptr<NegFunction> p = s->ptr<NegFunction>();
-            addMul(p->arg);
-        } else if (s->is<Constant>()) {
-            constants.push_back(s);
-        } else {
-            mul_terms.push_back(s);
-        }
-    }
-
-    void addDiv(Symbol s) {
-        if (s->is<MulFunction>()) {
-            std::shared_ptr<MulFunction> p = s->ptr<MulFunction>();
-            addDiv(p->arg0);
-            addDiv(p->arg1);
-        } else if (s->is<DivFunction>()) {
-            std::shared_ptr<DivFunction> p = s->ptr<DivFunction>();
-            addMul(p->arg1);
-        } else if (s->is<NegFunction>()) {
-            is_negative = not is_negative;
-            std::shared_ptr<NegFunction> p = s->ptr<NegFunction>();
-            addDiv(p->arg);
-        } else if (s->is<Constant>()) {
-            inv_constants.push_back(s);
-        } else {
-            div_terms.push_back(s);
-        }
-    }
+    void addMul(Symbol s) { add(s, 1); }
+    void addDiv(Symbol s) { add(s, -1); }
 
-    bool canBeSimplified() const {
-        for (auto &&p : mul_terms) {
-            for (auto &&n : div_terms) {
-                if (p == n) {
-                    return true;
-                }
+    // sums the exponents, must be called before simplified
+    bool canBeSimplified() {
+        std::sort(factors.begin(), factors.end(), [](const Factor &lhs, const Factor &rhs) { return lhs.base < rhs.base; });
+        bool merged = false;
+        std::vector<Factor> result;
+        for (auto &&f : factors) {
+            if (result.size() and result.back().base == f.base) {
+                result.back().exponent += f.exponent;
+                merged = true;
+            } else {
+                result.push_back(f);
             }
         }
-        return (constants.size() + inv_constants.size()) > 1;
+        factors.swap(result);
+        return merged or num_constants > 1 or
+            (num_constants == 1 and (constant == 0 or constant == 1 or constant == -1));
     }
 
     Symbol simplified() const {
-        std::vector<bool> used(div_terms.size(), false);
-        double v = is_negative ? -1 : 1;
-        for (auto &&c : constants) {
-            v *= c.eval();
-        }
-        for (auto &&c : inv_constants) {
-            v /= c.eval();
+        double v = is_negative ? -constant : constant;
+        if (v == 0) {
+            return zero();
         }
-        Symbol s(v), ds(1);
-        for (auto &&p : mul_terms) {
-            bool found = false;
-            for (size_t i = 0; i < div_terms.size(); i++) {
-                if (used[i]) {
-                    continue;
-                }
-                if (p == div_terms[i]) {
-                    used[i] = true;
-                    found = true;
-                    break;
-                }
-            }
-            if (found) {
+        std::vector<Symbol> numerators, denominators;
+        for (auto &&f : factors) {
+            if (f.exponent == 0) {
                 continue;
             }
-            s *= p;
+            double e = std::abs(f.exponent);
+            (f.exponent > 0 ? numerators : denominators).push_back(
+                e == 1 ? f.base : make_symbol<PowFunction>(f.base, Symbol(e)));
         }
-        for (size_t i = 0; i < div_terms.size(); i++) {
-            if (used[i]) {
-                continue;
-            }
-            ds *= div_terms[i];
+        if (denominators.size()) {
+            numerators.push_back(make_symbol<DivFunction>(product(denominators)));
         }
-        return s / ds;
+        if (v != 1 and v != -1) {
+            numerators.push_back(Symbol(v));
+        }
+        Symbol s = product(numerators);
+        return v == -1 ? make_symbol<NegFunction>(s) : s;
     }
 
-
     bool is_negative = false;
-    std::vector<Symbol> mul_terms, div_terms;
-    std::vector<Symbol> constants, inv_constants;
+
+ private:
+    struct Factor {
+        Symbol base;
+        double exponent;
+    };
+
+    void add(Symbol s, double exponent) {
+        if (s->is<MulFunction>()) {
+            for (auto &&a : s->ptr<MulFunction>()->operands()) {
+                add(a, exponent);
+            }
+        } else if (s->is<DivFunction>()) {
+            add(s->ptr<DivFunction>()->arg1, -exponent);
+        } else if (s->is<NegFunction>()) {
+            is_negative = not is_negative;
+            add(s->ptr<NegFunction>()->arg, exponent);
+        } else if (s->is<Constant>()) {
+            constant *= exponent > 0 ? s.eval() : 1 / s.eval();
+            num_constants++;
+        } else if (s->is<PowFunction>() and is_constant(s->ptr<PowFunction>()->arg1)) {
+            PowFunction *p = s->ptr<PowFunction>();
+            factors.push_back({p->arg0, exponent * p->arg1.eval()});
+        } else {
+            factors.push_back({s, exponent});
+        }
+    }
+
+ private:
+    std::vector<Factor> factors;
+    double constant = 1;
+    int num_constants = 0;
 };
 
 }  // namespace sym
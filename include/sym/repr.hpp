@@ -11,6 +11,7 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <stdexcept>
 
 namespace sym {
 
@@ -24,24 +25,96 @@ struct Repr {
         std::string s;
         int id;
     };
-    std::string operator()(const std::vector<Repr> &id2repr) const {
-        std::stringstream ss;
-        for (auto &&item : items) {
-            if (item.is_id) {
-                if (id2repr[item.id].invalid) {
-                    throw std::runtime_error("access invalid id");
-                }
-                ss << id2repr[item.id](id2repr);
+    std::string operator()(const std::vector<Repr> &id2repr) const;
+    bool invalid = false;
+    std::vector<Item> items;
+};
+
+/**
+ * renders nodes of a Repr list. every node is rendered at most once and the
+ * result is reused by all of its parents, so shared subexpressions do not
+ * blow up the rendering time. if limit is not zero, a child whose rendering
+ * is longer than limit characters is elided to "...#<id>", which can not be
+ * mistaken for a variable of the printed code.
+ */
+template<class ReprList = std::vector<Repr>>
+class ReprRenderer {
+ public:
+    ReprRenderer(const ReprList &id2repr_, size_t limit_ = 0) : id2repr(&id2repr_), limit(limit_) {}
+
+    const std::string &operator()(int id) {
+        reserve();
+        return render(id);
+    }
+
+    std::string operator()(const Repr &repr) {
+        reserve();
+        return render(repr);
+    }
+
+    // pins the rendering of id, e.g. to the name of the variable holding it
+    void assign(int id, const std::string &s) {
+        reserve();
+        cache[id] = s;
+        generations[id] = generation;
+    }
+
+    // drops every cached rendering, must be called when the Repr list changes
+    void invalidate() { generation++; }
+
+    void setLimit(size_t limit_) {
+        limit = limit_;
+        invalidate();
+    }
+
+ private:
+    void reserve() {
+        if (cache.size() < id2repr->size()) {
+            cache.resize(id2repr->size());
+            generations.resize(id2repr->size(), 0);
+        }
+    }
+
+    const std::string &render(int id) {
+        if (generations[id] != generation) {
+            if ((*id2repr)[id].invalid) {
+                throw std::runtime_error("access invalid id");
+            }
+            cache[id] = render((*id2repr)[id]);
+            generations[id] = generation;
+        }
+        return cache[id];
+    }
+
+    std::string render(const Repr &repr) {
+        std::string result;
+        for (auto &&item : repr.items) {
+            if (not item.is_id) {
+                result += item.s;
+                continue;
+            }
+            const std::string &s = render(item.id);
+            if (limit > 0 and s.size() > limit) {
+                result += "...#" + std::to_string(item.id);
             } else {
-                ss << item.s;
+                result += s;
             }
         }
-        return ss.str();
+        return result;
     }
-    bool invalid = false;
-    std::vector<Item> items;
+
+ private:
+    const ReprList *id2repr;
+    size_t limit;
+    std::vector<std::string> cache;
+    std::vector<size_t> generations;
+    size_t generation{1};
 };
 
+inline std::string Repr::operator()(const std::vector<Repr> &id2repr) const {
+    return ReprRenderer<>(id2repr)(*this);
+}
+
 template<class ...T>
 Repr _repr(const T&... args) {
     Repr r;
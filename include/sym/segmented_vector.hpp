@@ -0,0 +1,88 @@
+/**
+ * Copyright
+ * @file segmented_vector.hpp
+ * @brief
+ * @author Shogo Sawai
+ * @date 2018-12-06 18:02:45
+ */
+#ifndef SEGMENTED_VECTOR_HPP_
+#define SEGMENTED_VECTOR_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace sym {
+
+/**
+ * append-only vector whose elements never move. segment k holds
+ * (base << k) elements, so 32 segment pointers are enough for any size.
+ * elements that are already there can be read while another thread appends,
+ * appending itself has to be serialized by the caller.
+ */
+template<class T, int base_bits = 10>
+class SegmentedVector {
+    static constexpr int num_segments = 32;
+    static constexpr size_t base = size_t(1) << base_bits;
+
+ public:
+    SegmentedVector() : count(0) {
+        for (auto &&s : segments) {
+            s.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    SegmentedVector(const SegmentedVector &) = delete;
+    SegmentedVector &operator=(const SegmentedVector &) = delete;
+    ~SegmentedVector() {
+        clear();
+    }
+
+    T &operator[](size_t i) {
+        auto [k, j] = locate(i);
+        return segments[k].load(std::memory_order_acquire)[j];
+    }
+
+    const T &operator[](size_t i) const {
+        auto [k, j] = locate(i);
+        return segments[k].load(std::memory_order_acquire)[j];
+    }
+
+    size_t size() const { return count.load(std::memory_order_acquire); }
+
+    template<class U>
+    void push_back(U &&v) {
+        size_t i = count.load(std::memory_order_relaxed);
+        auto [k, j] = locate(i);
+        T *segment = segments[k].load(std::memory_order_relaxed);
+        if (not segment) {
+            segment = new T[base << k];
+            segments[k].store(segment, std::memory_order_release);
+        }
+        segment[j] = std::forward<U>(v);
+        count.store(i + 1, std::memory_order_release);
+    }
+
+    // must not run concurrently with any other access
+    void clear() {
+        for (auto &&s : segments) {
+            delete [] s.exchange(nullptr, std::memory_order_relaxed);
+        }
+        count.store(0, std::memory_order_relaxed);
+    }
+
+ private:
+    static std::pair<size_t, size_t> locate(size_t i) {
+        uint64_t n = i + base;
+        size_t k = 63 - __builtin_clzll(n) - base_bits;
+        return {k, n - (base << k)};
+    }
+
+ private:
+    std::atomic<T*> segments[num_segments];
+    std::atomic<size_t> count;
+};
+
+}  // namespace sym
+
+#endif  // SEGMENTED_VECTOR_HPP_
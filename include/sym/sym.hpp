@@ -16,6 +16,7 @@
 #include "cxx_code_printer.hpp"
 #include "factory.hpp"
 #include "io.hpp"
+#include "dag_file.hpp"
 #include "function_impl.hpp"
 #include "unary_function_impl.hpp"
 #include "binary_function_impl.hpp"
@@ -25,12 +26,42 @@
 
 namespace sym {
 
+// first line of a generated file, identifies the graph and the options it was printed from
+inline std::string cache_stamp(uint64_t hash) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "// sym %016llx", static_cast<unsigned long long>(hash));
+    return buf;
+}
+
+inline bool is_up_to_date(const std::string &path, const std::string &stamp) {
+    std::ifstream ifs(path);
+    std::string line;
+    return ifs and std::getline(ifs, line) and line == stamp;
+}
+
+// leaves the file and its timestamp untouched if the contents did not change
+inline void write_if_changed(const std::string &path, const std::string &contents) {
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        if (ifs) {
+            std::stringstream ss;
+            ss << ifs.rdbuf();
+            if (ss.str() == contents) {
+                return;
+            }
+        }
+    }
+    std::ofstream ofs(path, std::ios::binary);
+    ofs << contents;
+    if (not ofs) {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
+
 template<class F>
 int default_main(int argc, char **argv) {
-    F factory;
-
-    bool test_mode = false, dag_mode = false;
-    std::string function_name, ns_name, class_name, output_name = "-";
+    bool test_mode = false, dag_mode = false, use_cache = true;
+    std::string function_name, ns_name, class_name, output_name = "-", save_name, load_name;
     for (int arg = 1; arg < argc; arg++) {
         auto check_arg = [&](char short_opt, const std::string &long_opt, bool increment_arg) {
             if (std::string(argv[arg]) == std::string("-") + std::string({short_opt}) or
@@ -54,31 +85,65 @@ int default_main(int argc, char **argv) {
             test_mode = true;
         } else if (check_arg('\0', "dag", false)) {
             dag_mode = true;
+        } else if (check_arg('\0', "save", true)) {
+            save_name = argv[arg];
+        } else if (check_arg('\0', "load", true)) {
+            load_name = argv[arg];
+        } else if (check_arg('\0', "no-cache", false)) {
+            use_cache = false;
         }
     }
 
-    factory.generate();
+    std::unique_ptr<Factory> factory_ptr;
+    if (load_name != "") {
+        factory_ptr = std::make_unique<LoadedFactory>(load_name);
+    } else {
+        auto f = std::make_unique<F>();
+        f->generate();
+        factory_ptr = std::move(f);
+    }
+    Factory &factory = *factory_ptr;
+    for (auto &&r : factory.swellReports()) {
+        std::cerr << "diff of " << r.function << " by " << r.variable << " added " << r.num_nodes
+                  << " nodes, built again through the local partials" << std::endl;
+    }
+    if (save_name != "") {
+        factory.save(save_name);
+    }
+
+    // an output file stamped with the same graph and options is up to date, printing is skipped
+    auto write_output = [&](const std::string &mode, const std::string &file_header, auto print) {
+        if (output_name == "-") {
+            print(std::cout);
+            return;
+        }
+        uint64_t hash = factory.canonicalHash();
+        for (auto &&option : {mode, ns_name, class_name, std::to_string(CxxCodePrinter::format_version)}) {
+            hash = fnv1a(option, hash);
+        }
+        std::string stamp = cache_stamp(hash);
+        if (use_cache and is_up_to_date(output_name, stamp)) {
+            return;
+        }
+        std::stringstream ss;
+        ss << stamp << std::endl << file_header;
+        print(ss);
+        write_if_changed(output_name, ss.str());
+    };
 
     if (test_mode) {
         
     } else if (dag_mode) {
-        if (output_name == "-") {
-            std::cout << factory.digraph() << std::endl;
-        } else {
-            std::ofstream ofs(output_name);
-            ofs << factory.digraph() << std::endl;
-        }
+        write_output("dag", "", [&](std::ostream &os) {
+                os << factory.digraph() << std::endl;
+            });
     } else if (class_name != "") {
-        if (output_name == "-") {
-            std::cout << factory.cxxCodePrinter(ns_name, class_name) << std::endl;
-        } else {
-            std::ofstream ofs(output_name);
-            ofs << "#pragma once" << std::endl;
-            ofs << factory.cxxCodePrinter(ns_name, class_name) << std::endl;
-        }
+        write_output("class", "#pragma once\n", [&](std::ostream &os) {
+                os << factory.cxxCodePrinter(ns_name, class_name) << std::endl;
+            });
     } else if (function_name != "") {
         
-    } else {
+    } else if (save_name == "") {
         std::cerr << "no option specified" << std::endl;
         return -1;
     }
@@ -16,10 +16,15 @@ namespace sym {
 
 class UnaryFunction : public Function {
  public:
-    UnaryFunction(const std::string &operator_, const Symbol &arg_)
-        : Function(_repr("(", operator_, "(", arg_->id(), "))"), {arg_->id()}), arg(arg_) {}
+    UnaryFunction(OpCode op_, const char *operator_, const Symbol &arg_)
+        : Function(op_), token(operator_), arg(arg_) {}
 
  protected:
+    virtual NodeKey key() const override { return {_op, {arg->id()}, 0, ""}; }
+    virtual Repr reprTemplate() const override { return _repr("(", token, "(", arg->id(), "))"); }
+
+ protected:
+    const char *token;
     Symbol arg;
 };
 
@@ -27,10 +32,13 @@ class ASExtractor;
 class MDExtractor;
 class NegFunction : public UnaryFunction {
  public:
-    NegFunction(const Symbol &arg_) : UnaryFunction("-", arg_) {}
+    static constexpr OpCode opcode = OpCode::NEG;
+
+    NegFunction(const Symbol &arg_) : UnaryFunction(opcode, "-", arg_) {}
     virtual void simplified() const override;
     virtual double eval() const override { return -arg->eval(); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<NegFunction>(arg->subs(m)); }
+    virtual Symbol partial(int) const override { return negative_one(); }
  protected:
     virtual Symbol _diff(Symbol v) const override {
         return make_symbol<NegFunction>(arg->diff(v));
@@ -41,7 +49,9 @@ class NegFunction : public UnaryFunction {
 
 class SinFunction : public UnaryFunction {
  public:
-    SinFunction(const Symbol &arg_) : UnaryFunction("sin", arg_) {}
+    static constexpr OpCode opcode = OpCode::SIN;
+
+    SinFunction(const Symbol &arg_) : UnaryFunction(opcode, "sin", arg_) {}
     virtual void simplified() const override {
         arg->simplified();
         if (is_constant(arg)) {
@@ -51,13 +61,16 @@ class SinFunction : public UnaryFunction {
     }
     virtual double eval() const override { return std::sin(arg->eval()); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<SinFunction>(arg->subs(m)); }
+    virtual Symbol partial(int index) const override;
  protected:
     virtual Symbol _diff(Symbol v) const override;
 };
 
 class CosFunction : public UnaryFunction {
  public:
-    CosFunction(const Symbol &arg_) : UnaryFunction("cos", arg_) {}
+    static constexpr OpCode opcode = OpCode::COS;
+
+    CosFunction(const Symbol &arg_) : UnaryFunction(opcode, "cos", arg_) {}
     virtual void simplified() const override {
         arg->simplified();
         if (is_constant(arg)) {
@@ -67,13 +80,16 @@ class CosFunction : public UnaryFunction {
     }
     virtual double eval() const override { return std::cos(arg->eval()); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<CosFunction>(arg->subs(m)); }
+    virtual Symbol partial(int index) const override;
  protected:
     virtual Symbol _diff(Symbol v) const override;
 };
 
 class SquareRootFunction : public UnaryFunction {
  public:
-    SquareRootFunction(const Symbol &arg_) : UnaryFunction("sqrt", arg_) {}
+    static constexpr OpCode opcode = OpCode::SQRT;
+
+    SquareRootFunction(const Symbol &arg_) : UnaryFunction(opcode, "sqrt", arg_) {}
     virtual void simplified() const override {
         arg->simplified();
         if (is_constant(arg)) {
@@ -83,13 +99,16 @@ class SquareRootFunction : public UnaryFunction {
     }
     virtual double eval() const override { return std::sqrt(arg->eval()); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<SquareRootFunction>(arg->subs(m)); }
+    virtual Symbol partial(int index) const override;
  protected:
     virtual Symbol _diff(Symbol v) const override;
 };
 
 class ExpFunction : public UnaryFunction {
  public:
-    ExpFunction(const Symbol &arg_) : UnaryFunction("exp", arg_) {}
+    static constexpr OpCode opcode = OpCode::EXP;
+
+    ExpFunction(const Symbol &arg_) : UnaryFunction(opcode, "exp", arg_) {}
     virtual void simplified() const override {
         arg->simplified();
         if (is_constant(arg)) {
@@ -99,13 +118,16 @@ class ExpFunction : public UnaryFunction {
     }
     virtual double eval() const override { return std::exp(arg->eval()); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<ExpFunction>(arg->subs(m)); }
+    virtual Symbol partial(int index) const override;
  protected:
     virtual Symbol _diff(Symbol v) const override;
 };
 
 class LogFunction : public UnaryFunction {
  public:
-    LogFunction(const Symbol &arg_) : UnaryFunction("log", arg_) {}
+    static constexpr OpCode opcode = OpCode::LOG;
+
+    LogFunction(const Symbol &arg_) : UnaryFunction(opcode, "log", arg_) {}
     virtual void simplified() const override {
         arg->simplified();
         if (is_constant(arg)) {
@@ -115,13 +137,16 @@ class LogFunction : public UnaryFunction {
     }
     virtual double eval() const override { return std::log(arg->eval()); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<LogFunction>(arg->subs(m)); }
+    virtual Symbol partial(int index) const override;
  protected:
     virtual Symbol _diff(Symbol v) const override;
 };
 
 class ArcSinFunction : public UnaryFunction {
  public:
-    ArcSinFunction(const Symbol &arg_) : UnaryFunction("asin", arg_) {}
+    static constexpr OpCode opcode = OpCode::ASIN;
+
+    ArcSinFunction(const Symbol &arg_) : UnaryFunction(opcode, "asin", arg_) {}
     virtual void simplified() const override {
         arg->simplified();
         if (is_constant(arg)) {
@@ -131,13 +156,16 @@ class ArcSinFunction : public UnaryFunction {
     }
     virtual double eval() const override { return std::asin(arg->eval()); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<ArcSinFunction>(arg->subs(m)); }
+    virtual Symbol partial(int index) const override;
  protected:
     virtual Symbol _diff(Symbol v) const override;
 };
 
 class ArcCosFunction : public UnaryFunction {
  public:
-    ArcCosFunction(const Symbol &arg_) : UnaryFunction("acos", arg_) {}
+    static constexpr OpCode opcode = OpCode::ACOS;
+
+    ArcCosFunction(const Symbol &arg_) : UnaryFunction(opcode, "acos", arg_) {}
     virtual void simplified() const override {
         arg->simplified();
         if (is_constant(arg)) {
@@ -147,6 +175,7 @@ class ArcCosFunction : public UnaryFunction {
     }
     virtual double eval() const override { return std::acos(arg->eval()); }
     virtual Symbol subs(const std::map<Symbol, Symbol> &m) const override { return make_symbol<ArcCosFunction>(arg->subs(m)); }
+    virtual Symbol partial(int index) const override;
  protected:
     virtual Symbol _diff(Symbol v) const override;
 };
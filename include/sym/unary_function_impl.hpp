@@ -78,6 +78,46 @@ inline Symbol ArcCosFunction::_diff(Symbol v) const {
                                              make_symbol<MulFunction>(arg, arg))))));
 }
 
+inline Symbol SinFunction::partial(int) const {
+    return make_symbol<CosFunction>(arg);
+}
+
+inline Symbol CosFunction::partial(int) const {
+    return make_symbol<NegFunction>(make_symbol<SinFunction>(arg));
+}
+
+inline Symbol SquareRootFunction::partial(int) const {
+    return make_symbol<DivFunction>(
+        make_symbol<MulFunction>(
+            make_symbol<Constant>(2),
+            make_symbol<SquareRootFunction>(arg)));
+}
+
+inline Symbol ExpFunction::partial(int) const {
+    return make_symbol<ExpFunction>(arg);
+}
+
+inline Symbol LogFunction::partial(int) const {
+    return make_symbol<DivFunction>(arg);
+}
+
+inline Symbol ArcSinFunction::partial(int) const {
+    return make_symbol<DivFunction>(
+        make_symbol<SquareRootFunction>(
+            make_symbol<SubFunction>(
+                make_symbol<Constant>(1),
+                make_symbol<MulFunction>(arg, arg))));
+}
+
+inline Symbol ArcCosFunction::partial(int) const {
+    return make_symbol<NegFunction>(
+        make_symbol<DivFunction>(
+            make_symbol<SquareRootFunction>(
+                make_symbol<SubFunction>(
+                    make_symbol<Constant>(1),
+                    make_symbol<MulFunction>(arg, arg)))));
+}
+
 }  // namespace sym
 
 #endif  // UNARY_FUNCTION_IMPL_HPP_
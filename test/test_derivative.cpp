@@ -0,0 +1,372 @@
+/**
+ * Copyright 
+ * @file test_derivative.cpp
+ * @brief
+ * @author Shogo Sawai
+ * @date 2018-12-08 10:21:37
+ */
+#include "cpput.hpp"
+
+#include <fstream>
+#include <cstring>
+
+#include "sym/sym.hpp"
+
+namespace {
+
+using namespace sym;
+
+struct derivative : public Factory {
+    StaticInput x{"x", 4};
+    StaticOutput y{"y", 4};
+
+    Symbol cost() {
+        Symbol s = sin(x[0] * x[1]) + exp(x[2]) / (x[3] + 2.0);
+        s = s * sqrt(x[0] * x[0] + 1.0) - log(x[1] + 3.0);
+        s = s + asin(x[2] * 0.5) * acos(x[3] * 0.25) - cos(x[0] - x[3]);
+        s = s + make_symbol<Atan2Function>(x[1], x[2] + 2.0) + (-x[0] * x[0]) / x[1];
+        return s;
+    }
+};
+
+TEST_F(derivative, gradient) {
+    Symbol f = cost();
+    std::vector<Symbol> g = gradient(f, x);
+    ASSERT_EQ(g.size(), 4u);
+    x.assign({0.3, 1.7, 0.4, -0.6});
+    for (int i = 0; i < 4; i++) {
+        ASSERT_NEAR(g[i].eval(), diff(f, x[i]).eval(), 1.0e-12);
+    }
+}
+
+TEST_F(derivative, gradient_sparse) {
+    Symbol f = sin(x[0]) * x[1] + x[1];
+    std::vector<Symbol> g = gradient(f, x);
+    ASSERT_EQ(g[2], zero());
+    ASSERT_EQ(g[3], zero());
+    x.assign({0.3, 1.7, 0.4, -0.6});
+    ASSERT_NEAR(g[0].eval(), std::cos(0.3) * 1.7, 1.0e-15);
+    ASSERT_NEAR(g[1].eval(), std::sin(0.3) + 1.0, 1.0e-15);
+    ASSERT_EQ(gradient(x[2], x)[2], one());
+}
+
+TEST_F(derivative, memoized_diff) {
+    Symbol f = cost();
+    Symbol d0 = diff(diff(f, x[0]), x[1]);
+    size_t n = size();
+    Symbol d1 = diff(diff(f, x[0]), x[1]);
+    ASSERT_EQ(d0, d1);
+    ASSERT_EQ(size(), n);
+}
+
+TEST_F(derivative, diff_node_budget) {
+    Symbol f = cost();
+
+    derivative k;
+    k.setDiffNodeBudget(10);
+    Symbol g = k.cost();
+    // stopped, reported and built again through the local partials
+    std::vector<Symbol> budgeted, parallel(4);
+    for (int i = 0; i < 4; i++) {
+        budgeted.push_back(k.diff(k.diff(g, k.x[i]), k.x[0]));
+    }
+    ASSERT_TRUE(k.swellReports().size() > 0u);
+    ASSERT_EQ(k.swellReports()[0].variable, "x[0]");
+    ASSERT_TRUE(k.swellReports()[0].num_nodes > 10u);
+    size_t num_reports = k.swellReports().size();
+    k.parallelFor(4, [&](int i) { parallel[i] = k.diff(k.diff(g, k.x[i]), k.x[2]); }, 2);
+    ASSERT_TRUE(k.swellReports().size() > num_reports);
+
+    std::vector<double> values{0.3, 1.7, 0.4, -0.6}, expected, expected_parallel;
+    {
+        FactoryBase::Scope scope(*this);
+        x.assign(values);
+        for (int i = 0; i < 4; i++) {
+            expected.push_back(diff(diff(f, x[i]), x[0]).eval());
+            expected_parallel.push_back(diff(diff(f, x[i]), x[2]).eval());
+        }
+        ASSERT_EQ(swellReports().size(), 0u);
+    }
+    FactoryBase::Scope scope(k);
+    k.x.assign(values);
+    for (int i = 0; i < 4; i++) {
+        ASSERT_NEAR(budgeted[i].eval(), expected[i], 1.0e-12);
+        ASSERT_NEAR(parallel[i].eval(), expected_parallel[i], 1.0e-12);
+    }
+}
+
+TEST_F(derivative, jacobian) {
+    y[0] = sin(x[0] * x[1]);
+    y[1] = exp(x[2]) * x[0];
+    y[2] = x[3];
+    y[3] = sin(x[0] * x[1]) * x[3];
+    std::vector<std::vector<Symbol>> j = jacobian(y, x);
+    ASSERT_EQ(j.size(), 4u);
+    ASSERT_EQ(j[0][2], zero());
+    ASSERT_EQ(j[1][1], zero());
+    ASSERT_EQ(j[2][3], one());
+    x.assign({0.3, 1.7, 0.4, -0.6});
+    for (int k = 0; k < 4; k++) {
+        for (int i = 0; i < 4; i++) {
+            ASSERT_EQ(j[k][i], diff(y[k], x[i]));
+        }
+    }
+}
+
+TEST_F(derivative, hessian) {
+    Symbol f = cost();
+    std::vector<std::vector<Symbol>> h = hessian(f, x);
+    x.assign({0.3, 1.7, 0.4, -0.6});
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            ASSERT_EQ(h[i][j], h[j][i]);
+            ASSERT_NEAR(h[i][j].eval(), diff(diff(f, x[i]), x[j]).eval(), 1.0e-12);
+        }
+    }
+}
+
+TEST_F(derivative, hvp) {
+    StaticInput v{"v", 4};
+    Symbol f = cost();
+    std::vector<Symbol> hv = hvp(f, x, v);
+    std::vector<std::vector<Symbol>> h = hessian(f, x);
+    x.assign({0.3, 1.7, 0.4, -0.6});
+    v.assign({0.5, -1.0, 2.0, 0.25});
+    for (int i = 0; i < 4; i++) {
+        double expected = 0;
+        for (int j = 0; j < 4; j++) {
+            expected += h[i][j].eval() * v[j].eval();
+        }
+        ASSERT_NEAR(hv[i].eval(), expected, 1.0e-12);
+    }
+}
+
+struct products : public Factory {
+    DynamicInput x{"x", 3};
+    DynamicInput v{"v", 3};
+    DynamicInput w{"w", 2};
+    DynamicOutput y{"y", 2};
+    DynamicOutput jv{"jv", 2};
+    DynamicOutput wj{"wj", 3};
+
+    void generate() {
+        y[0] = sin(x[0] * x[1]) + x[2] * x[2];
+        y[1] = exp(x[1]) / (x[2] + 2.0);
+        jv.assign(jvp(y, x, v));
+        wj.assign(vjp(y, x, w));
+    }
+};
+
+TEST(products, jvp_vjp) {
+    products k;
+    k.generate();
+    std::vector<std::vector<Symbol>> j = k.jacobian(k.y, k.x);
+    k.x.assign({0.3, 1.7, 0.4});
+    k.v.assign({0.5, -1.0, 2.0});
+    k.w.assign({-0.3, 0.7});
+    std::vector<double> v{0.5, -1.0, 2.0}, w{-0.3, 0.7};
+    for (int r = 0; r < 2; r++) {
+        double expected = 0;
+        for (int c = 0; c < 3; c++) {
+            expected += j[r][c].eval() * v[c];
+        }
+        ASSERT_NEAR(k.jv[r].eval(), expected, 1.0e-12);
+    }
+    for (int c = 0; c < 3; c++) {
+        double expected = 0;
+        for (int r = 0; r < 2; r++) {
+            expected += w[r] * j[r][c].eval();
+        }
+        ASSERT_NEAR(k.wj[c].eval(), expected, 1.0e-12);
+    }
+    ASSERT_EQ(k.jvp(k.y, k.x, std::vector<Symbol>{zero(), zero(), one()})[0], j[0][2]);
+}
+
+struct gauss_newton : public Factory {
+    DynamicInput p{"p", 3};
+    StaticInput w{"w", 4};
+    DynamicOutput r{"r", 4};
+    DynamicOutput jtj{"jtj", 6};
+    DynamicOutput jtr{"jtr", 3};
+
+    void generate() {
+        for (int k = 0; k < 4; k++) {
+            r[k] = p[0] * exp(p[1] * (k * 0.5)) + p[2] - k * 1.5;
+        }
+        auto [a, b] = normalEquations(r, p, {w[0], w[1], w[2], w[3]});
+        jtj.assign(a);
+        jtr.assign(b);
+    }
+};
+
+TEST(normal_equations, weighted) {
+    gauss_newton k;
+    k.generate();
+    std::vector<std::vector<Symbol>> j = k.jacobian(k.r, k.p);
+    k.p.assign({0.8, -0.3, 0.1});
+    k.w.assign({1.0, 0.5, 2.0, 0.25});
+    std::vector<double> w{1.0, 0.5, 2.0, 0.25};
+    for (int i = 0, index = 0; i < 3; i++) {
+        for (int l = i; l < 3; l++, index++) {
+            double expected = 0;
+            for (int n = 0; n < 4; n++) {
+                expected += j[n][i].eval() * w[n] * j[n][l].eval();
+            }
+            ASSERT_NEAR(k.jtj[index].eval(), expected, 1.0e-12);
+        }
+        double expected = 0;
+        for (int n = 0; n < 4; n++) {
+            expected += j[n][i].eval() * w[n] * k.r[n].eval();
+        }
+        ASSERT_NEAR(k.jtr[i].eval(), expected, 1.0e-12);
+    }
+    auto [jtj, jtr] = k.normalEquations(k.r, k.p);
+    ASSERT_NEAR(jtj[5].eval(), 4.0, 1.0e-15);  // d r / d p[2] = 1
+    ASSERT_NEAR(jtr[2].eval(), k.r[0].eval() + k.r[1].eval() + k.r[2].eval() + k.r[3].eval(), 1.0e-12);
+}
+
+struct unrolled : public Factory {
+    DynamicInput x0{"x0", 2};
+    DynamicInput p{"p", 2};
+    StaticInput dt{"dt", 1};
+    DynamicOutput y{"y", 1};
+
+    void generate(int num_checkpoints) {
+        y[0] = p[0] * x0[0];
+        auto step = [this](const std::vector<Symbol> &x) {
+            return std::vector<Symbol>{x[0] + dt[0] * x[1], x[1] - dt[0] * (p[0] * sin(x[0]) + p[1] * x[1])};
+        };
+        auto loss = [](const std::vector<Symbol> &x) { return x[0] * x[0] + x[1] * x[1]; };
+        addCheckpointedGradient("g", std::vector<Symbol>{x0[0], x0[1]}, p, 1000, num_checkpoints, step, loss);
+    }
+};
+
+TEST(checkpointed_gradient, print) {
+    unrolled k0;
+    k0.generate(3);
+    unrolled k1;
+    k1.generate(4);
+    ASSERT_NEQ(k0.canonicalHash(), k1.canonicalHash());
+    std::stringstream ss;
+    ss << k0.cxxCodePrinter("ns", "C");
+    std::string code = ss.str();
+    ASSERT_TRUE(code.find("void g(const ProbeScalar *x0, const ProbeScalar *p, ProbeScalar *g_value, ProbeScalar *g_gradient) const {") != std::string::npos);
+    ASSERT_TRUE(code.find("_g_reverse(x0, p, 0, 1000, _x0, _a, g_gradient, 3);") != std::string::npos);
+    // the step is printed once, not unrolled, and nothing of it is computed by refresh
+    ASSERT_TRUE(code.size() < 10000u);
+    ASSERT_TRUE(code.find("_i[") == std::string::npos);
+}
+
+struct sparse_jacobian : public Factory {
+    DynamicInput x{"x", 3};
+    DynamicOutput r{"r", 3};
+    DynamicSparseOutput J{"J", 3, 3};
+
+    void generate() {
+        r[0] = x[0] * x[0] - 1.0;
+        r[1] = sin(x[1]) * x[2];
+        r[2] = x[2];
+        J.assign(jacobian(r, x));
+    }
+};
+
+TEST(sparse_output, pattern) {
+    sparse_jacobian k;
+    k.generate();
+    ASSERT_EQ(k.J.nnz(), 4u);
+    ASSERT_TRUE(k.J.sparsePattern().row_offsets == std::vector<int>({0, 1, 3, 4}));
+    ASSERT_TRUE(k.J.sparsePattern().col_indices == std::vector<int>({0, 1, 2, 2}));
+    ASSERT_EQ(k.J(1, 0), zero());
+    ASSERT_EQ(k.J(2, 2), one());
+    k.J.set(2, 2, zero());
+    k.J.set(0, 2, k.x[1]);
+    ASSERT_TRUE(k.J.sparsePattern().row_offsets == std::vector<int>({0, 2, 4, 4}));
+    ASSERT_TRUE(k.J.sparsePattern().col_indices == std::vector<int>({0, 2, 1, 2}));
+
+    std::stringstream ss;
+    ss << k.cxxCodePrinter("ns", "C");
+    ASSERT_TRUE(ss.str().find("static constexpr int J_nnz = 4;") != std::string::npos);
+    ASSERT_TRUE(ss.str().find("static constexpr int J_row_offsets[4] = {0, 2, 4, 4};") != std::string::npos);
+
+    k.save("test_derivative_0.dag");
+    LoadedFactory l("test_derivative_0.dag");
+    std::remove("test_derivative_0.dag");
+    ASSERT_EQ(l.output("J").size(), 4u);
+    ASSERT_EQ(l.canonicalHash(), k.canonicalHash());
+}
+
+TEST(sparse_output, broken_pattern) {
+    sparse_jacobian k;
+    k.generate();
+    k.save("test_derivative_2.dag");
+    std::string s;
+    {
+        std::ifstream f("test_derivative_2.dag", std::ios::binary);
+        s.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    }
+    DagHeader h;
+    std::memcpy(&h, s.data(), sizeof(h));
+    // J is the only sparse output, its row offsets {0, 1, 3, 4} are followed by its column indices
+    for (auto &&[entry, value] : {std::make_tuple(2, 0), std::make_tuple(4, 3), std::make_tuple(5, -1)}) {
+        std::string broken(s);
+        std::memcpy(&broken[h.patterns_offset + entry * sizeof(int32_t)], &value, sizeof(value));
+        {
+            std::ofstream f("test_derivative_2.dag", std::ios::binary);
+            f.write(broken.data(), broken.size());
+        }
+        std::string error;
+        try {
+            LoadedFactory l("test_derivative_2.dag");
+        } catch (const std::runtime_error &e) {
+            error = e.what();
+        }
+        ASSERT_EQ(error, std::string("broken graph file : test_derivative_2.dag"));
+    }
+    std::remove("test_derivative_2.dag");
+}
+
+struct banded_hessian : public Factory {
+    DynamicInput x{"x", 8};
+    DynamicSparseOutput H{"H", 8, 8};
+
+    Symbol cost() {
+        Symbol f = zero();
+        for (int i = 0; i + 1 < 8; i++) {
+            Symbol d = x[i + 1] - x[i] * x[i];
+            f = f + d * d + sin(x[i]);
+        }
+        return f;
+    }
+};
+
+TEST(sparse_output, compressed_hessian) {
+    banded_hessian k;
+    Symbol f = k.cost();
+    SparsePattern pattern = k.hessianPattern(f, k.x);
+    ASSERT_EQ(pattern.nnz(), 22u);
+    std::vector<int> colors = colorColumns(pattern);
+    ASSERT_EQ(*std::max_element(colors.begin(), colors.end()), 2);
+    k.H.compress(pattern, colors, k.compressedHessian(f, k.x, colors));
+    ASSERT_EQ(k.H.sparsePattern().num_colors, 3);
+
+    std::vector<std::vector<Symbol>> h = k.hessian(f, k.x);
+    k.x.assign({0.3, 1.7, 0.4, -0.6, 0.1, 0.9, -1.1, 0.2});
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            ASSERT_NEAR(k.H(i, j).eval(), h[i][j].eval(), 1.0e-12);
+        }
+    }
+
+    std::stringstream ss;
+    ss << k.cxxCodePrinter("ns", "C");
+    ASSERT_TRUE(ss.str().find("static constexpr int H_num_colors = 3;") != std::string::npos);
+    ASSERT_TRUE(ss.str().find("static constexpr int H_compressed_indices[22]") != std::string::npos);
+
+    k.save("test_derivative_1.dag");
+    LoadedFactory l("test_derivative_1.dag");
+    std::remove("test_derivative_1.dag");
+    ASSERT_EQ(l.output("H").size(), 24u);
+    ASSERT_EQ(l.canonicalHash(), k.canonicalHash());
+}
+
+}  // namespace
@@ -0,0 +1,394 @@
+/**
+ * Copyright 
+ * @file test_factory.cpp
+ * @brief
+ * @author Shogo Sawai
+ * @date 2018-12-05 10:12:31
+ */
+#include "cpput.hpp"
+
+#include <thread>
+#include <fstream>
+#include <cstring>
+
+#include "sym/sym.hpp"
+
+namespace {
+
+using namespace sym;
+
+struct factory : public Factory {
+    StaticInput x{"x", 3};
+    StaticOutput y{"y", 3};
+};
+
+TEST_F(factory, hash_consing) {
+    y[0] = sin(x[0] * x[1]) + x[2];
+    y[1] = sin(x[0] * x[1]) + x[2];
+    ASSERT_EQ(y[0], y[1]);
+    ASSERT_NEQ(y[0], (sin(x[1] * x[0]) - x[2]));
+}
+
+TEST_F(factory, shared_operand_pairs) {
+    y[0] = x[0] * x[1] * x[2];
+    y[1] = sin(x[2]) * x[1] * x[0];
+    y[2] = x[2];
+    size_t num_nodes = size();
+    uint64_t hash = canonicalHash();
+    std::stringstream ss;
+    ss << cxxCodePrinter("ns", "C");
+    std::string code = ss.str();
+    size_t first = code.find("(x[0]*x[1])");
+    ASSERT_TRUE(first != std::string::npos);
+    ASSERT_TRUE(code.find("(x[0]*x[1])", first + 1) == std::string::npos);
+    // the pair is no node of the factory
+    ASSERT_EQ(size(), num_nodes);
+    ASSERT_EQ(canonicalHash(), hash);
+    std::stringstream again;
+    again << cxxCodePrinter("ns", "C");
+    ASSERT_EQ(again.str(), code);
+}
+
+TEST(print_layout, static_pair) {
+    struct : public Factory {
+        DynamicInput x{"x", 2};
+        StaticInput p{"p", 2};
+        DynamicOutput y{"y", 2};
+    } f;
+    FactoryBase::Scope scope(f);
+    f.y[0] = f.p[0] * f.p[1] * f.x[0];
+    f.y[1] = f.p[1] * f.x[1] * f.p[0];
+    size_t num_nodes = f.size();
+    std::stringstream ss;
+    ss << f.cxxCodePrinter("ns", "C");
+    std::string code = ss.str();
+    // computed once with the static variables and read by the dynamic ones
+    ASSERT_TRUE(code.find("_i[0] = ") != std::string::npos);
+    ASSERT_TRUE(code.find("(x[0]*_i[0])") != std::string::npos);
+    ASSERT_TRUE(code.find("(x[1]*_i[0])") != std::string::npos);
+    ASSERT_EQ(f.size(), num_nodes);
+}
+
+TEST_F(factory, repr_limit) {
+    Symbol s = x[0];
+    for (int i = 0; i < 8; i++) {
+        s = s * s + x[1];
+    }
+    // 2^8 copies of x[0] when fully expanded
+    ASSERT_TRUE(s.repr().size() > 256 * 4);
+    FactoryBase::setReprLimit(16);
+    ASSERT_TRUE(s.repr().size() < 64);
+    ASSERT_TRUE(s.repr().find("...#") != std::string::npos);
+    FactoryBase::setReprLimit(0);
+    ASSERT_TRUE(s.repr().size() > 256 * 4);
+}
+
+TEST_F(factory, variable_depends) {
+    Symbol s = sin(x[0] * x[1]) + 2;
+    ASSERT_TRUE(FactoryBase::checkDepends(s->id(), x[0]->id()));
+    ASSERT_TRUE(FactoryBase::checkDepends(s->id(), x[1]->id()));
+    ASSERT_FALSE(FactoryBase::checkDepends(s->id(), x[2]->id()));
+    ASSERT_TRUE(FactoryBase::checkDepends(x[2]->id(), x[2]->id()));
+    // simplified to x[1]
+    Symbol t = x[0] + x[1] - x[0];
+    ASSERT_FALSE(FactoryBase::checkDepends(t->id(), x[0]->id()));
+}
+
+TEST_F(factory, constant) {
+    ASSERT_NEQ(Symbol(1.0e-7), zero());
+    ASSERT_FALSE(is_zero(Symbol(1.0e-7)));
+    ASSERT_TRUE(is_zero(Symbol(-0.0)));
+    ASSERT_EQ(Symbol(0.1 + 0.2), Symbol(0.1 + 0.2));
+    ASSERT_NEQ(Symbol(0.1 + 0.2), Symbol(0.3));
+    ASSERT_EQ(std::stod(Symbol(0.1 + 0.2).repr()), 0.1 + 0.2);
+    ASSERT_EQ(Symbol(1.0e-7).repr(), "1e-07");
+    ASSERT_EQ(Symbol(2).repr(), "2.0");
+    ASSERT_EQ(Symbol(-2).repr(), "(-2.0)");
+}
+
+TEST_F(factory, collect) {
+    struct : public Factory {
+        StaticInput x{"x", 1};
+    } other;
+    Scope scope(*this);
+    y[0] = sin(x[0] * x[1]) + x[2];
+    Symbol s = cos(x[1]) * x[2];
+    for (int i = 0; i < 3; i++) {
+        diff(diff(y[0], x[i]), x[(i + 1) % 3]);
+    }
+    Symbol s2 = x[0] - x[0];  // aliased to 0
+    x.assign({0.5, 0.25, 2.0});
+    std::string y0 = y[0].repr(), s0 = s.repr();
+    double y0_value = y[0].eval(), s0_value = s.eval();
+    size_t size0 = size();
+
+    size_t removed;
+    {
+        // collects this factory, not the current one
+        Scope other_scope(other);
+        removed = collect();
+    }
+    ASSERT_TRUE(removed > 0);
+    ASSERT_TRUE(size() < size0);
+    ASSERT_EQ(y[0].repr(), y0);
+    ASSERT_EQ(s.repr(), s0);
+    ASSERT_EQ(y[0].eval(), y0_value);
+    ASSERT_EQ(s.eval(), s0_value);
+    ASSERT_TRUE(is_zero(s2));
+    // nothing left to remove, hash-consing still finds the live nodes
+    ASSERT_EQ(collect(), 0u);
+    ASSERT_EQ(sin(x[0] * x[1]) + x[2], y[0]);
+    ASSERT_EQ(diff(s, x[2]), cos(x[1]));
+
+    setCollectionThreshold(1);
+    Symbol d = diff(diff(y[0], x[0]), x[0]);
+    size_t size1 = size();
+    ASSERT_EQ(diff(y[0], x[1]).repr(), "(x[0]*(cos((x[0]*x[1]))))");
+    ASSERT_TRUE(size() <= size1 + 1);
+    ASSERT_EQ(d, diff(diff(y[0], x[0]), x[0]));
+}
+
+TEST_F(factory, expand_factor) {
+    ASSERT_EQ(expand(x[0] * (x[1] + x[2])), x[0] * x[1] + x[0] * x[2]);
+    ASSERT_EQ(expand((x[0] + x[1]) * (x[0] - x[1])), x[0] * x[0] - x[1] * x[1]);
+    ASSERT_EQ(factor(x[0] * x[1] + x[0] * x[2]), x[0] * (x[1] + x[2]));
+    // horner form of a polynomial
+    Symbol p = 1 + x[1] * x[0] + x[2] * pow(x[0], 2) + pow(x[0], 3);
+    ASSERT_EQ(factor(p), 1 + x[0] * (x[1] + x[0] * (x[2] + x[0])));
+    ASSERT_TRUE(flopCount({factor(p)}) < flopCount({p}));
+
+    x.assign({0.3, -1.1, 0.7});
+    Symbol r2 = x[0] * x[0] + x[1] * x[1];
+    y[0] = x[2] * (1 + 0.1 * r2 + 0.01 * r2 * r2);
+    y[1] = (x[0] + x[1]) * (x[0] + x[1]) - x[0] * x[0] - x[1] * x[1];
+    y[2] = r2;
+    double y0 = y[0].eval();
+    setAutoExpandFactor(true);
+    std::stringstream ss;
+    ss << cxxCodePrinter("ns", "C");
+    ASSERT_NEAR(y[0].eval(), y0, 1.0e-12);
+    ASSERT_EQ(y[1], 2 * x[0] * x[1]);
+    ASSERT_EQ(y[2], r2);
+}
+
+TEST_F(factory, egraph) {
+    y[0] = x[1] * (sin(x[0]) * sin(x[0]) + x[2]) + x[1] * (cos(x[0]) * cos(x[0]) - x[2]);
+    y[1] = cos(x[0]) * (1 - sin(x[0])) + (1 + sin(x[0])) * cos(x[0]);
+    y[2] = (x[0] + x[1]) * (x[0] - x[1]) + x[1] * x[1];
+    // none of them is simplified while it is built
+    ASSERT_NEQ(y[0], x[1]);
+    ASSERT_NEQ(y[1], 2 * cos(x[0]));
+    ASSERT_NEQ(y[2], x[0] * x[0]);
+    setEGraphBudget(2000);
+    EGraphReport report = optimizeEGraph();
+    ASSERT_EQ(y[0], x[1]);
+    ASSERT_EQ(y[1], 2 * cos(x[0]));
+    ASSERT_EQ(y[2], x[0] * x[0]);
+    ASSERT_TRUE(report.cost_after < report.cost_before);
+}
+
+struct kernel : public Factory {
+    DynamicInput x{"x", 2};
+    StaticInput p{"p", 1};
+    DynamicOutput y{"y", 2};
+
+    void generate() {
+        y[0] = sin(x[0] * p[0]) * cos(x[1]) + x[0];
+        y[1] = diff(y[0], x[0]);
+    }
+};
+
+std::string generate_kernel() {
+    kernel k;
+    k.generate();
+    std::stringstream ss;
+    ss << k.cxxCodePrinter("ns", "C");
+    return ss.str();
+}
+
+TEST(dag_file, save_load) {
+    kernel k;
+    k.generate();
+    k.save("test_factory_0.dag");
+    LoadedFactory l0("test_factory_0.dag");
+    l0.save("test_factory_1.dag");
+    LoadedFactory l1("test_factory_1.dag");
+    std::ifstream f0("test_factory_0.dag", std::ios::binary), f1("test_factory_1.dag", std::ios::binary);
+    std::string s0((std::istreambuf_iterator<char>(f0)), std::istreambuf_iterator<char>());
+    std::string s1((std::istreambuf_iterator<char>(f1)), std::istreambuf_iterator<char>());
+    ASSERT_TRUE(s0.size() > sizeof(DagHeader));
+    ASSERT_TRUE(s0 == s1);
+    std::remove("test_factory_0.dag");
+    std::remove("test_factory_1.dag");
+
+    std::stringstream c0, c1;
+    c0 << l0.cxxCodePrinter("ns", "C");
+    c1 << l1.cxxCodePrinter("ns", "C");
+    ASSERT_EQ(c0.str(), c1.str());
+
+    {
+        FactoryBase::Scope scope(k);
+        k.x.assign({0.3, -1.2});
+        k.p.assign({2.5});
+    }
+    FactoryBase::Scope scope(l0);
+    std::vector<double> x{0.3, -1.2}, p{2.5};
+    for (int i = 0; i < 2; i++) {
+        l0.input("x")[i]->ptr<Variable>()->assign(x[i]);
+    }
+    l0.input("p")[0]->ptr<Variable>()->assign(p[0]);
+    for (int i = 0; i < 2; i++) {
+        double expected;
+        std::string expected_repr;
+        {
+            FactoryBase::Scope scope(k);
+            expected = k.y[i].eval();
+            expected_repr = k.y[i].repr();
+        }
+        ASSERT_EQ(l0.output("y")[i].eval(), expected);
+        ASSERT_EQ(l0.output("y")[i].repr(), expected_repr);
+    }
+}
+
+TEST(dag_file, broken_offsets) {
+    kernel k;
+    k.generate();
+    k.save("test_factory_2.dag");
+    std::string s;
+    {
+        std::ifstream f("test_factory_2.dag", std::ios::binary);
+        s.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    }
+    DagHeader h;
+    std::memcpy(&h, s.data(), sizeof(h));
+    ASSERT_TRUE(h.num_nodes > 2u);
+    // the children of the second last node end before they start, those of the last node span all args
+    uint32_t offset = 0;
+    std::memcpy(&s[h.arg_offsets_offset + (h.num_nodes - 1) * sizeof(uint32_t)], &offset, sizeof(offset));
+    {
+        std::ofstream f("test_factory_2.dag", std::ios::binary);
+        f.write(s.data(), s.size());
+    }
+    // rejected by the header check, before any child is read
+    std::string error;
+    try {
+        LoadedFactory l("test_factory_2.dag");
+    } catch (const std::runtime_error &e) {
+        error = e.what();
+    }
+    std::remove("test_factory_2.dag");
+    ASSERT_EQ(error, std::string("broken graph file : test_factory_2.dag"));
+}
+
+TEST(dag_file, canonical_hash) {
+    kernel k0;
+    k0.generate();
+    kernel k1;
+    Symbol garbage = cos(k1.x[1] * k1.x[0]);  // shifts the node ids
+    k1.generate();
+    kernel k2;
+    k2.generate();
+    k2.y[1] = k2.y[1] + 1.0;
+    ASSERT_EQ(k0.canonicalHash(), k1.canonicalHash());
+    ASSERT_NEQ(k0.canonicalHash(), k2.canonicalHash());
+    // operands are printed, and so rounded, in the order they were created in
+    kernel k3;
+    Symbol sin_first = sin(k3.x[0] * k3.p[0]);
+    k3.generate();
+    kernel k4;
+    Symbol cos_first = cos(k4.x[1]);
+    k4.generate();
+    {
+        FactoryBase::Scope scope(k3);
+        std::string repr = k3.y[0].repr();
+        FactoryBase::Scope other_scope(k4);
+        ASSERT_NEQ(repr, k4.y[0].repr());
+    }
+    ASSERT_NEQ(k3.canonicalHash(), k4.canonicalHash());
+
+    // the dag output covers the hashed nodes only
+    auto num_nodes = [](const Digraph &d) {
+        std::stringstream ss;
+        ss << d;
+        std::string s = ss.str();
+        size_t n = 0;
+        for (size_t i = s.find("[label="); i != std::string::npos; i = s.find("[label=", i + 1)) {
+            n++;
+        }
+        return n;
+    };
+    ASSERT_EQ(num_nodes(k0.digraph()), num_nodes(k1.digraph()));
+
+    // options that change the printed code change the hash
+    uint64_t h0 = k0.canonicalHash();
+    k0.setAutoExpandFactor(true);
+    ASSERT_NEQ(k0.canonicalHash(), h0);
+    k0.setAutoExpandFactor(false);
+    ASSERT_EQ(k0.canonicalHash(), h0);
+    k0.setEGraphBudget(2000);
+    uint64_t h1 = k0.canonicalHash();
+    ASSERT_NEQ(h1, h0);
+    k0.setEGraphBudget(2000, 8);
+    ASSERT_NEQ(k0.canonicalHash(), h1);
+    k0.setEGraphBudget(0);
+    ASSERT_EQ(k0.canonicalHash(), h0);
+}
+
+TEST(context, threads) {
+    std::string expected = generate_kernel();
+    std::vector<std::string> results(4);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < results.size(); i++) {
+        threads.emplace_back([&results, i]() { results[i] = generate_kernel(); });
+    }
+    for (auto &&t : threads) {
+        t.join();
+    }
+    for (auto &&r : results) {
+        ASSERT_EQ(r, expected);
+    }
+}
+
+TEST(context, scope) {
+    kernel k0;
+    kernel k1;
+    // k1 is current
+    Symbol s1 = k1.x[0] + k1.x[1];
+    {
+        FactoryBase::Scope scope(k0);
+        Symbol s0 = sin(k0.x[0]);
+        ASSERT_EQ(s0.repr(), "(sin(x[0]))");
+    }
+    ASSERT_EQ(s1.repr(), "(x[0]+x[1])");
+    ASSERT_EQ(FactoryBase::get(), &k1);
+}
+
+TEST(context, parallel_for) {
+    struct : public Factory {
+        StaticInput x{"x", 16};
+    } f;
+    Symbol s = zero();
+    for (int i = 0; i < 16; i++) {
+        s = s + sin(f.x[i] * f.x[(i + 1) % 16]) * cos(f.x[i]);
+    }
+    std::vector<Symbol> jacobian(16);
+    f.parallelFor(16, [&](int i) { jacobian[i] = f.diff(f.diff(s, f.x[i]), f.x[(i + 3) % 16]); }, 4);
+    std::vector<double> values(16);
+    for (int i = 0; i < 16; i++) {
+        values[i] = 0.1 * i + 0.3;
+    }
+    f.x.assign(values);
+    for (int i = 0; i < 16; i++) {
+        Symbol expected = f.diff(f.diff(s, f.x[i]), f.x[(i + 3) % 16]);
+        ASSERT_EQ(jacobian[i].eval(), expected.eval());
+    }
+    bool thrown = false;
+    try {
+        f.parallelFor(16, [](int i) { if (i == 7) { throw std::runtime_error("failed"); } }, 4);
+    } catch (std::runtime_error &) {
+        thrown = true;
+    }
+    ASSERT_TRUE(thrown);
+}
+
+}  // namespace
@@ -36,9 +36,18 @@ TEST_F(four_arithmetic_operations, add_diff) {
 TEST_F(four_arithmetic_operations, add_simplified) {
     y[0] = (x[0] + 1);
     // std::cout << y[0].repr() << std::endl;
-    ASSERT_EQ(y[0].repr(), "(1.000000+x[0])");
+    ASSERT_EQ(y[0].repr(), "(1.0+x[0])");
     y[0] = (x[0] + 1) + (x[1] + 1);
-    ASSERT_EQ(y[0].repr(), "((2.000000+x[0])+x[1])");
+    ASSERT_EQ(y[0].repr(), "(2.0+x[0]+x[1])");
+}
+
+TEST_F(four_arithmetic_operations, nary) {
+    ASSERT_EQ((x[2] + x[0]) + x[1], x[0] + (x[1] + x[2]));
+    ASSERT_EQ(x[1] * (x[2] * x[0]), (x[0] * x[1]) * x[2]);
+    ASSERT_EQ((x[1] + x[0] + x[2]).repr(), "(x[0]+x[1]+x[2])");
+    ASSERT_EQ(((x[0] + x[1]) - x[0]), x[1]);
+    ASSERT_EQ(((x[2] * x[0]) / x[0]), x[2]);
+    ASSERT_EQ(diff(x[0] * x[1] * x[2], x[1]), x[0] * x[2]);
 }
 
 TEST_F(four_arithmetic_operations, sub_eval) {
@@ -77,9 +86,9 @@ TEST_F(four_arithmetic_operations, mul_simplified) {
     y[0] = 1 * x[0];
     ASSERT_EQ(y[0].repr(), "x[0]");
     y[0] = 1 * x[0] * 3;
-    ASSERT_EQ(y[0].repr(), "(3.000000*x[0])");
+    ASSERT_EQ(y[0].repr(), "(3.0*x[0])");
     y[0] = 2 * x[0] * 2;
-    ASSERT_EQ(y[0].repr(), "(4.000000*x[0])");
+    ASSERT_EQ(y[0].repr(), "(4.0*x[0])");
     // y[0] = 2 * x[0] * 2 * x[0];
     // std::cout << y[0].repr() << std::endl;
 }
@@ -7,6 +7,8 @@
  */
 #include "cpput.hpp"
 
+#include <sstream>
+
 #include "sym/sym.hpp"
 
 namespace {
@@ -32,4 +34,39 @@ TEST_F(simplify, add_sub) {
     // ASSERT_EQ(cos(x[0]) * (1 - sin(x[0])) + (1 + sin(x[0])) * cos(x[0]), zero());
 }
 
+TEST_F(simplify, like_terms) {
+    ASSERT_EQ(x[0] + x[0], 2 * x[0]);
+    ASSERT_EQ(3 * x[0] - x[0], 2 * x[0]);
+    ASSERT_EQ(x[0] * x[1] + 2 * x[1] * x[0], 3 * (x[0] * x[1]));
+    ASSERT_EQ(x[0] + sin(x[1]) - (x[0] + x[0]), sin(x[1]) - x[0]);
+    ASSERT_EQ(x[0] - 0.5 * x[0] - 0.5 * x[0], zero());
+}
+
+TEST_F(simplify, powers) {
+    ASSERT_EQ(x[0] * x[0] * x[0] / x[0], pow(x[0], 2));
+    ASSERT_EQ(pow(x[0], 2) * x[0], pow(x[0], 3));
+    ASSERT_EQ(pow(pow(x[0], 0.5), 4), pow(x[0], 2));
+    ASSERT_EQ(x[1] / (x[1] * x[1]), 1 / x[1]);
+    ASSERT_EQ(pow(x[0], 2).repr(), "(x[0]*x[0])");
+    ASSERT_EQ(pow(x[0], -3).repr(), "(1.0/(x[0]*x[0]*x[0]))");
+    ASSERT_EQ(pow(x[0], 5).repr(), "_pow5(x[0])");
+    ASSERT_EQ(pow(x[0], 0.5).repr(), "pow(x[0], 0.5)");
+    ASSERT_EQ(pow(x[0], max_chain_exponent).repr(), "_pow" + std::to_string(max_chain_exponent) + "(x[0])");
+    ASSERT_EQ(pow(x[0], max_chain_exponent + 1).repr(), "pow(x[0], " + std::to_string(max_chain_exponent + 1) + ".0)");
+
+    x.assign({1.3, 0.7, 0.2});
+    Symbol f = pow(x[0], 5) * pow(x[1], x[0]);
+    ASSERT_NEAR(diff(f, x[0]).eval(), (5 * std::pow(1.3, 4) + std::pow(1.3, 5) * std::log(0.7)) * std::pow(0.7, 1.3), 1.0e-12);
+    ASSERT_NEAR(diff(f, x[1]).eval(), std::pow(1.3, 6) * std::pow(0.7, 0.3), 1.0e-12);
+
+    y[0] = pow(x[0], 7);
+    y[1] = pow(x[1], 15);
+    y[2] = pow(x[2], 2.5);
+    std::stringstream ss;
+    ss << cxxCodePrinter("ns", "C");
+    ASSERT_TRUE(ss.str().find("static IntermediateScalar _pow7(const IntermediateScalar &x1) {") != std::string::npos);
+    // 15 takes 5 multiplications, the binary method takes 6
+    ASSERT_EQ(addition_chain(15).size(), 6u);
+}
+
 }  // namespace
@@ -7,6 +7,8 @@
  */
 #include "cpput.hpp"
 
+#include <sstream>
+
 #include "sym/sym.hpp"
 
 namespace {
@@ -54,6 +56,29 @@ TEST_F(trigonometric, cos_diff) {
     ASSERT_EQ(diff(y[1], x[0]), ((- x[1]) * sin(x[0] * x[1])));
 }
 
+TEST_F(trigonometric, pythagorean) {
+    ASSERT_EQ(pow(sin(x[0]), 2) + pow(cos(x[0]), 2), one());
+    ASSERT_EQ(x[1] * sin(x[0]) * sin(x[0]) + cos(x[0]) * x[1] * cos(x[0]), x[1]);
+    ASSERT_EQ(2 * x[1] * pow(sin(x[0]), 2) - x[1] + 2 * x[1] * pow(cos(x[0]), 2), x[1]);
+    ASSERT_NEQ(pow(sin(x[0]), 2) + pow(cos(x[1]), 2), one());
+}
+
+TEST_F(trigonometric, sincos) {
+    y[0] = sin(x[0]) * x[1];
+    y[1] = cos(x[0]) * x[2];
+    y[2] = sin(x[1]);
+    std::stringstream ss;
+    ss << cxxCodePrinter("ns", "C");
+    std::string code = ss.str();
+    // sin and cos of x[0] are computed by one call
+    ASSERT_TRUE(code.find("_sincos(IntermediateScalar(x[0]), ") != std::string::npos);
+    ASSERT_TRUE(code.find("template <class T> static void _sincos(const T &x, T &s, T &c) {") != std::string::npos);
+    // double and float call sincos of the math library
+    ASSERT_TRUE(code.find("__builtin_sincos(x, &s_, &c_);") != std::string::npos);
+    ASSERT_TRUE(code.find("__builtin_sincosf(x, &s_, &c_);") != std::string::npos);
+    ASSERT_TRUE(code.find("cos(x[0])") == std::string::npos);
+    ASSERT_TRUE(code.find("sin(x[1])") != std::string::npos);
+}
 
 }  // namespace
 